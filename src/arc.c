@@ -77,18 +77,58 @@ arc4_getbyte(struct arc4_stream *as)
 	return (as->s[(si + sj) & 0xff]);
 }
 
+/*
+ * The next byte of the key stream of as, with its indices in the local
+ * variables i and j, and si and sj as scratch.
+ */
+#define ARC4_BYTE(as, i, j, si, sj) \
+	(i++, si = (as)->s[i], j += si, sj = (as)->s[j], \
+	 (as)->s[i] = sj, (as)->s[j] = si, (as)->s[(si + sj) & 0xff])
+
 u_int32_t
-arc4_getword(as)
-	struct arc4_stream *as;
+arc4_getword(struct arc4_stream *as)
 {
+	u_int8_t i = as->i, j = as->j, si, sj;
 	u_int32_t val;
-	val = arc4_getbyte(as) << 24;
-	val |= arc4_getbyte(as) << 16;
-	val |= arc4_getbyte(as) << 8;
-	val |= arc4_getbyte(as);
+
+	val = (u_int32_t)ARC4_BYTE(as, i, j, si, sj) << 24;
+	val |= (u_int32_t)ARC4_BYTE(as, i, j, si, sj) << 16;
+	val |= (u_int32_t)ARC4_BYTE(as, i, j, si, sj) << 8;
+	val |= (u_int32_t)ARC4_BYTE(as, i, j, si, sj);
+
+	as->i = i;
+	as->j = j;
 	return val;
 }
 
+/* The same key stream as arc4_getbyte, n bytes at a time */
+
+void
+arc4_fill(struct arc4_stream *as, u_char *buf, size_t n)
+{
+	u_int8_t i = as->i, j = as->j, si, sj;
+
+	while (n--)
+		*buf++ = ARC4_BYTE(as, i, j, si, sj);
+
+	as->i = i;
+	as->j = j;
+}
+
+/* Encrypts or decrypts n bytes from src to dst, which may be the same */
+
+void
+arc4_xor(struct arc4_stream *as, u_char *dst, const u_char *src, size_t n)
+{
+	u_int8_t i = as->i, j = as->j, si, sj;
+
+	while (n--)
+		*dst++ = *src++ ^ ARC4_BYTE(as, i, j, si, sj);
+
+	as->i = i;
+	as->j = j;
+}
+
 void
 arc4_addrandom(struct arc4_stream *as, u_char *dat, int datlen)
 {
@@ -52,6 +52,8 @@ struct arc4_stream {
 void arc4_init(struct arc4_stream *as);
 u_int8_t arc4_getbyte(struct arc4_stream *as);
 u_int32_t arc4_getword(struct arc4_stream *as);
+void arc4_fill(struct arc4_stream *as, u_char *buf, size_t n);
+void arc4_xor(struct arc4_stream *as, u_char *dst, const u_char *src, size_t n);
 void arc4_addrandom(struct arc4_stream *as, u_char *dat, int datlen);
 void arc4_initkey(struct arc4_stream *as, char *type, u_char *key, int keylen);
 
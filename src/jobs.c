@@ -0,0 +1,102 @@
+/*
+ * This file is under the same license of the outguess.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif /* HAVE_PTHREAD */
+
+#include "jobs.h"
+
+#define JOBS_MAXTHREADS	64
+
+static int nthreads = 1;
+
+void
+jobs_setthreads(int n)
+{
+	if (n < 1)
+		n = 1;
+	if (n > JOBS_MAXTHREADS)
+		n = JOBS_MAXTHREADS;
+#ifndef HAVE_PTHREAD
+	n = 1;
+#endif /* HAVE_PTHREAD */
+	nthreads = n;
+}
+
+int
+jobs_threads(void)
+{
+	return (nthreads);
+}
+
+#ifdef HAVE_PTHREAD
+struct jobs {
+	pthread_mutex_t lock;
+	int next;		/* next job to hand out */
+	int njobs;
+	void (*job)(void *, int);
+	void *arg;
+};
+
+static void *
+jobs_worker(void *p)
+{
+	struct jobs *jobs = p;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		if (i >= jobs->njobs)
+			break;
+		jobs->job(jobs->arg, i);
+	}
+
+	return (NULL);
+}
+#endif /* HAVE_PTHREAD */
+
+void
+jobs_run(int njobs, void (*job)(void *, int), void *arg)
+{
+	int i;
+#ifdef HAVE_PTHREAD
+	pthread_t tid[JOBS_MAXTHREADS];
+	struct jobs jobs;
+	int n;
+
+	n = nthreads < njobs ? nthreads : njobs;
+	if (n > 1) {
+		pthread_mutex_init(&jobs.lock, NULL);
+		jobs.next = 0;
+		jobs.njobs = njobs;
+		jobs.job = job;
+		jobs.arg = arg;
+
+		/* The calling thread does its share of the work as well */
+		for (i = 1; i < n; i++)
+			if (pthread_create(&tid[i], NULL, jobs_worker, &jobs)) {
+				perror("pthread_create");
+				exit(1);
+			}
+		jobs_worker(&jobs);
+		for (i = 1; i < n; i++)
+			pthread_join(tid[i], NULL);
+
+		pthread_mutex_destroy(&jobs.lock);
+		return;
+	}
+#endif /* HAVE_PTHREAD */
+
+	for (i = 0; i < njobs; i++)
+		job(arg, i);
+}
@@ -0,0 +1,20 @@
+/*
+ * This file is under the same license of the outguess.
+ */
+
+#ifndef _JOBS_H
+#define _JOBS_H
+
+/*
+ * A minimal way to spread independent pieces of work over several
+ * threads.  Without thread support the jobs simply run one after the
+ * other.
+ */
+
+void jobs_setthreads(int);
+int jobs_threads(void);
+
+/* Calls job(arg, i) for i in [0, njobs), and returns when all are done */
+void jobs_run(int njobs, void (*job)(void *, int), void *arg);
+
+#endif /* _JOBS_H */
@@ -32,6 +32,14 @@ typedef struct {
    */
   DCTELEM * divisors[NUM_QUANT_TBLS];
 
+#ifdef JSIMD_SSE2_SUPPORTED
+  /* Reciprocals of the divisors for jsimd_quantize, or NULL if it is not
+   * used for a table.
+   */
+  boolean use_simd;
+  unsigned int * recip[NUM_QUANT_TBLS];
+#endif
+
 #ifdef DCT_FLOAT_SUPPORTED
   /* Same as above for the floating-point case. */
   float_DCT_method_ptr do_float_dct;
@@ -41,7 +49,31 @@ typedef struct {
 
 typedef my_fdct_controller * my_fdct_ptr;
 
-short steg_use_bit (unsigned short temp);
+void steg_use_block (void * ctx, JCOEFPTR block);
+
+/*
+ * Compute the reciprocals of a table of integer divisors, if they are used.
+ */
+
+LOCAL(void)
+start_pass_recip (j_compress_ptr cinfo, int qtblno)
+{
+#ifdef JSIMD_SSE2_SUPPORTED
+  my_fdct_ptr fdct = (my_fdct_ptr) cinfo->fdct;
+
+  if (! fdct->use_simd)
+    return;
+
+  if (fdct->recip[qtblno] == NULL) {
+    fdct->recip[qtblno] = (unsigned int *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				  DCTSIZE2 * SIZEOF(unsigned int));
+  }
+  if (! jsimd_quant_recip(fdct->divisors[qtblno], fdct->recip[qtblno]))
+    fdct->recip[qtblno] = NULL;
+#endif
+}
+
 
 /*
  * Initialize for a processing pass.
@@ -86,6 +118,7 @@ start_pass_fdctmgr (j_compress_ptr cinfo)
       for (i = 0; i < DCTSIZE2; i++) {
 	dtbl[i] = ((DCTELEM) qtbl->quantval[i]) << 3;
       }
+      start_pass_recip(cinfo, qtblno);
       break;
 #endif
 #ifdef DCT_IFAST_SUPPORTED
@@ -123,6 +156,7 @@ start_pass_fdctmgr (j_compress_ptr cinfo)
 				  (INT32) aanscales[i]),
 		    CONST_BITS-3);
 	}
+	start_pass_recip(cinfo, qtblno);
       }
       break;
 #endif
@@ -189,6 +223,9 @@ forward_DCT (j_compress_ptr cinfo, jpeg_component_info * compptr,
   my_fdct_ptr fdct = (my_fdct_ptr) cinfo->fdct;
   forward_DCT_method_ptr do_dct = fdct->do_dct;
   DCTELEM * divisors = fdct->divisors[compptr->quant_tbl_no];
+#ifdef JSIMD_SSE2_SUPPORTED
+  unsigned int * recip = fdct->recip[compptr->quant_tbl_no];
+#endif
   DCTELEM workspace[DCTSIZE2];	/* work area for FDCT subroutine */
   JDIMENSION bi;
 
@@ -226,6 +263,10 @@ forward_DCT (j_compress_ptr cinfo, jpeg_component_info * compptr,
     (*do_dct) (workspace);
 
     /* Quantize/descale the coefficients, and store into coef_blocks[] */
+#ifdef JSIMD_SSE2_SUPPORTED
+    if (recip == NULL ||
+	! jsimd_quantize(coef_blocks[bi], divisors, recip, workspace))
+#endif
     { register DCTELEM temp, qval;
       register int i;
       register JCOEFPTR output_ptr = coef_blocks[bi];
@@ -259,9 +300,10 @@ forward_DCT (j_compress_ptr cinfo, jpeg_component_info * compptr,
 	  temp += qval>>1;	/* for rounding */
 	  DIVIDE_BY(temp, qval);
 	}
-	output_ptr[i] = steg_use_bit(temp);
+	output_ptr[i] = (JCOEF) temp;
       }
     }
+    steg_use_block(cinfo->client_data, coef_blocks[bi]);
   }
 }
 
@@ -332,6 +374,7 @@ forward_DCT_float (j_compress_ptr cinfo, jpeg_component_info * compptr,
 	 */
 	output_ptr[i] = (JCOEF) ((int) (temp + (FAST_FLOAT) 16384.5) - 16384);
       }
+      steg_use_block(cinfo->client_data, output_ptr);
     }
   }
 }
@@ -355,11 +398,19 @@ jinit_forward_dct (j_compress_ptr cinfo)
   cinfo->fdct = (struct jpeg_forward_dct *) fdct;
   fdct->pub.start_pass = start_pass_fdctmgr;
 
+#ifdef JSIMD_SSE2_SUPPORTED
+  fdct->use_simd = jsimd_sse2();
+#endif
+
   switch (cinfo->dct_method) {
 #ifdef DCT_ISLOW_SUPPORTED
   case JDCT_ISLOW:
     fdct->pub.forward_DCT = forward_DCT;
     fdct->do_dct = jpeg_fdct_islow;
+#ifdef JSIMD_SSE2_SUPPORTED
+    if (fdct->use_simd)
+      fdct->do_dct = jsimd_fdct_islow;
+#endif
     break;
 #endif
 #ifdef DCT_IFAST_SUPPORTED
@@ -382,6 +433,9 @@ jinit_forward_dct (j_compress_ptr cinfo)
   /* Mark divisor tables unallocated */
   for (i = 0; i < NUM_QUANT_TBLS; i++) {
     fdct->divisors[i] = NULL;
+#ifdef JSIMD_SSE2_SUPPORTED
+    fdct->recip[i] = NULL;
+#endif
 #ifdef DCT_FLOAT_SUPPORTED
     fdct->float_divisors[i] = NULL;
 #endif
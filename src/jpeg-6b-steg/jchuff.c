@@ -69,6 +69,9 @@ typedef struct {
   long * dc_count_ptrs[NUM_HUFF_TBLS];
   long * ac_count_ptrs[NUM_HUFF_TBLS];
 #endif
+
+  /* Restart intervals being encoded in parallel, or NULL */
+  struct par_encoder * par;
 } huff_entropy_encoder;
 
 typedef huff_entropy_encoder * huff_entropy_ptr;
@@ -89,6 +92,10 @@ typedef struct {
 METHODDEF(boolean) encode_mcu_huff JPP((j_compress_ptr cinfo,
 					JBLOCKROW *MCU_data));
 METHODDEF(void) finish_pass_huff JPP((j_compress_ptr cinfo));
+LOCAL(void) start_parallel JPP((j_compress_ptr cinfo));
+METHODDEF(boolean) encode_mcu_parallel JPP((j_compress_ptr cinfo,
+					    JBLOCKROW *MCU_data));
+METHODDEF(void) finish_pass_parallel JPP((j_compress_ptr cinfo));
 #ifdef ENTROPY_OPT_SUPPORTED
 METHODDEF(boolean) encode_mcu_gather JPP((j_compress_ptr cinfo,
 					  JBLOCKROW *MCU_data));
@@ -165,6 +172,11 @@ start_pass_huff (j_compress_ptr cinfo, boolean gather_statistics)
   /* Initialize restart stuff */
   entropy->restarts_to_go = cinfo->restart_interval;
   entropy->next_restart_num = 0;
+
+  /* Independent restart intervals may be encoded in parallel */
+  entropy->par = NULL;
+  if (! gather_statistics)
+    start_parallel(cinfo);
 }
 
 
@@ -443,6 +455,139 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
 }
 
 
+/* Upper bound on the bytes one block can produce, including stuffed zeros:
+ * at most (7 + 16 + MAX_COEF_BITS+1 + 63 * (16 + MAX_COEF_BITS) + 16) bits,
+ * which stays under DCTSIZE2*4 bytes before stuffing doubles it.
+ */
+#define BLOCK_BUFSIZE  (DCTSIZE2 * 8)
+
+
+#if defined(__GNUC__) && defined(__LP64__)
+
+/*
+ * Fast path for encode_one_block, used when the output buffer is known to
+ * have room for a whole block so we need not check for suspension per byte.
+ * Bits are collected right-justified in a 64-bit accumulator, each Huffman
+ * code is merged with the magnitude bits that follow it into one insertion,
+ * and output goes out 32 bits at a time; the per-byte 0xFF test is skipped
+ * for any word that contains no 0xFF byte.  The bytes produced are
+ * identical to those of the emit_bits path.
+ */
+
+#define HUFF_FAST_SUPPORTED
+
+/* Number of bits needed for the magnitude of a nonzero value */
+#define HUFF_NBITS(x)  (32 - __builtin_clz((unsigned int) (x)))
+
+/* Nonzero if any byte of the 32-bit value x is 0xFF */
+#define HAS_FF_BYTE(x)  \
+	((~(x) - 0x01010101U) & (x) & 0x80808080U)
+
+#define PUT_BYTE(c)  \
+	{ *out++ = (JOCTET) (c);  \
+	  if ((c) == 0xFF) *out++ = 0; }
+
+#define PUT_BITS(code,size)  \
+	{ put_buffer = (put_buffer << (size)) | (code);  \
+	  if ((put_bits += (size)) >= 32) {  \
+	    unsigned int w;  \
+	    put_bits -= 32;  \
+	    w = (unsigned int) (put_buffer >> put_bits);  \
+	    if (! HAS_FF_BYTE(w)) {  \
+	      out[0] = (JOCTET) (w >> 24); out[1] = (JOCTET) (w >> 16);  \
+	      out[2] = (JOCTET) (w >> 8); out[3] = (JOCTET) w;  \
+	      out += 4;  \
+	    } else {  \
+	      PUT_BYTE(w >> 24); PUT_BYTE((w >> 16) & 0xFF);  \
+	      PUT_BYTE((w >> 8) & 0xFF); PUT_BYTE(w & 0xFF);  \
+	    } } }
+
+LOCAL(void)
+encode_one_block_fast (working_state * state, JCOEFPTR block, int last_dc_val,
+		       c_derived_tbl *dctbl, c_derived_tbl *actbl)
+{
+  register unsigned long put_buffer;
+  register int put_bits = state->cur.put_bits;
+  register JOCTET * out = state->next_output_byte;
+  register int temp, temp2;
+  register int nbits, size;
+  register int k, r, i;
+
+  /* Move the pending bits (left-justified in 24 bits) to the bottom */
+  put_buffer = ((unsigned long) state->cur.put_buffer >> (24 - put_bits)) &
+	       ((1UL << put_bits) - 1);
+
+  /* Encode the DC coefficient difference per section F.1.2.1 */
+
+  temp = temp2 = block[0] - last_dc_val;
+  if (temp < 0) {
+    temp = -temp;
+    temp2--;
+  }
+  nbits = temp ? HUFF_NBITS(temp) : 0;
+  if (nbits > MAX_COEF_BITS+1)
+    ERREXIT(state->cinfo, JERR_BAD_DCT_COEF);
+
+  if ((size = dctbl->ehufsi[nbits]) == 0)
+    ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+  PUT_BITS(((unsigned long) dctbl->ehufco[nbits] << nbits) |
+	   ((unsigned int) temp2 & ((1U << nbits) - 1)), size + nbits);
+
+  /* Encode the AC coefficients per section F.1.2.2 */
+
+  r = 0;
+  for (k = 1; k < DCTSIZE2; k++) {
+    if ((temp = block[jpeg_natural_order[k]]) == 0) {
+      r++;
+      continue;
+    }
+    while (r > 15) {
+      if ((size = actbl->ehufsi[0xF0]) == 0)
+	ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+      PUT_BITS((unsigned long) actbl->ehufco[0xF0], size);
+      r -= 16;
+    }
+    temp2 = temp;
+    if (temp < 0) {
+      temp = -temp;
+      temp2--;
+    }
+    nbits = HUFF_NBITS(temp);
+    if (nbits > MAX_COEF_BITS)
+      ERREXIT(state->cinfo, JERR_BAD_DCT_COEF);
+    i = (r << 4) + nbits;
+    if ((size = actbl->ehufsi[i]) == 0)
+      ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+    PUT_BITS(((unsigned long) actbl->ehufco[i] << nbits) |
+	     ((unsigned int) temp2 & ((1U << nbits) - 1)), size + nbits);
+    r = 0;
+  }
+
+  /* If the last coef(s) were zero, emit an end-of-block code */
+  if (r > 0) {
+    if ((size = actbl->ehufsi[0]) == 0)
+      ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+    PUT_BITS((unsigned long) actbl->ehufco[0], size);
+  }
+
+  /* Write out whole bytes, keeping fewer than 8 bits as emit_bits does */
+  while (put_bits >= 8) {
+    int c;
+    put_bits -= 8;
+    c = (int) ((put_buffer >> put_bits) & 0xFF);
+    PUT_BYTE(c);
+  }
+
+  state->free_in_buffer -= out - state->next_output_byte;
+  state->next_output_byte = out;
+  state->cur.put_buffer = (INT32) ((put_buffer & ((1UL << put_bits) - 1))
+				   << (24 - put_bits));
+  state->cur.put_bits = put_bits;
+}
+
+#endif /* __GNUC__ && __LP64__ */
+
+
 /*
  * Emit a restart marker & resynchronize predictions.
  */
@@ -468,6 +613,42 @@ emit_restart (working_state * state, int restart_num)
 }
 
 
+/*
+ * Encode the blocks of one MCU into the working state.
+ */
+
+LOCAL(boolean)
+encode_mcu_blocks (working_state * state, JBLOCKROW *MCU_data)
+{
+  j_compress_ptr cinfo = state->cinfo;
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  int blkn, ci;
+  jpeg_component_info * compptr;
+
+  for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++) {
+    ci = cinfo->MCU_membership[blkn];
+    compptr = cinfo->cur_comp_info[ci];
+#ifdef HUFF_FAST_SUPPORTED
+    if (state->free_in_buffer >= BLOCK_BUFSIZE)
+      encode_one_block_fast(state,
+			    MCU_data[blkn][0], state->cur.last_dc_val[ci],
+			    entropy->dc_derived_tbls[compptr->dc_tbl_no],
+			    entropy->ac_derived_tbls[compptr->ac_tbl_no]);
+    else
+#endif
+    if (! encode_one_block(state,
+			   MCU_data[blkn][0], state->cur.last_dc_val[ci],
+			   entropy->dc_derived_tbls[compptr->dc_tbl_no],
+			   entropy->ac_derived_tbls[compptr->ac_tbl_no]))
+      return FALSE;
+    /* Update last_dc_val */
+    state->cur.last_dc_val[ci] = MCU_data[blkn][0][0];
+  }
+
+  return TRUE;
+}
+
+
 /*
  * Encode and output one MCU's worth of Huffman-compressed coefficients.
  */
@@ -477,8 +658,6 @@ encode_mcu_huff (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
 {
   huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
   working_state state;
-  int blkn, ci;
-  jpeg_component_info * compptr;
 
   /* Load up working state */
   state.next_output_byte = cinfo->dest->next_output_byte;
@@ -494,17 +673,8 @@ encode_mcu_huff (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
   }
 
   /* Encode the MCU data blocks */
-  for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++) {
-    ci = cinfo->MCU_membership[blkn];
-    compptr = cinfo->cur_comp_info[ci];
-    if (! encode_one_block(&state,
-			   MCU_data[blkn][0], state.cur.last_dc_val[ci],
-			   entropy->dc_derived_tbls[compptr->dc_tbl_no],
-			   entropy->ac_derived_tbls[compptr->ac_tbl_no]))
-      return FALSE;
-    /* Update last_dc_val */
-    state.cur.last_dc_val[ci] = MCU_data[blkn][0][0];
-  }
+  if (! encode_mcu_blocks(&state, MCU_data))
+    return FALSE;
 
   /* Completed MCU, so update state */
   cinfo->dest->next_output_byte = state.next_output_byte;
@@ -552,6 +722,225 @@ finish_pass_huff (j_compress_ptr cinfo)
 }
 
 
+/*
+ * Parallel encoding of restart intervals.
+ *
+ * Each restart interval starts with an empty bit buffer and zero DC
+ * predictions, so the intervals can be encoded independently.  When there
+ * are threads to use, encode_mcu_parallel collects the MCUs of a batch of
+ * intervals, the application's job runner encodes each interval into a
+ * buffer of its own, and the buffers are written out in order with RSTn
+ * markers between them.  The output is byte for byte the same as that of
+ * encode_mcu_huff with the same restart interval.
+ */
+
+/* Provided by the application: worker threads, and a way to use them */
+int steg_threads (void);
+void steg_run_jobs (int njobs, void (*job) (void *, int), void *arg);
+
+#define PAR_SEGS_PER_THREAD	4	/* segments per thread in one batch */
+#define PAR_MAX_BUFFER	((size_t) 64 << 20) /* limit on a batch's buffers */
+
+struct par_encoder {
+  j_compress_ptr cinfo;
+  int batch_segs;		/* segments encoded per batch */
+  JBLOCKROW buffer;		/* blocks of all MCUs in a batch */
+  JDIMENSION MCU_ctr;		/* MCUs in the buffer */
+  JOCTET * out;			/* encoded segments, seg_size bytes apart */
+  size_t seg_size;		/* room for one encoded segment */
+  size_t * seg_len;		/* length of each encoded segment */
+  JDIMENSION segs_done;		/* segments written so far in this scan */
+};
+
+
+/*
+ * Set up parallel encoding if it is possible and worthwhile.
+ */
+
+LOCAL(void)
+start_parallel (j_compress_ptr cinfo)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  struct par_encoder * par;
+  size_t seg_blocks, seg_mem;
+  int batch_segs;
+
+  if (cinfo->restart_interval == 0)
+    return;
+  /* The batch buffers are not counted against a memory limit */
+  if (cinfo->mem->max_memory_to_use != 0)
+    return;
+  batch_segs = steg_threads();
+  if (batch_segs <= 1)
+    return;
+
+  /* A segment's blocks, and room for them encoded plus the final flush */
+  seg_blocks = (size_t) cinfo->restart_interval * cinfo->blocks_in_MCU;
+  seg_mem = seg_blocks * SIZEOF(JBLOCK) + (seg_blocks + 1) * BLOCK_BUFSIZE;
+  batch_segs *= PAR_SEGS_PER_THREAD;
+  if ((size_t) batch_segs > PAR_MAX_BUFFER / seg_mem)
+    batch_segs = (int) (PAR_MAX_BUFFER / seg_mem);
+  if (batch_segs < 2)
+    return;
+
+  par = (struct par_encoder *)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				SIZEOF(struct par_encoder));
+  par->cinfo = cinfo;
+  par->batch_segs = batch_segs;
+  par->buffer = (JBLOCKROW)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				(size_t) batch_segs * seg_blocks *
+				SIZEOF(JBLOCK));
+  par->seg_size = (seg_blocks + 1) * BLOCK_BUFSIZE;
+  par->out = (JOCTET *)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				(size_t) batch_segs * par->seg_size);
+  par->seg_len = (size_t *)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				(size_t) batch_segs * SIZEOF(size_t));
+  par->MCU_ctr = 0;
+  par->segs_done = 0;
+
+  entropy->par = par;
+  entropy->pub.encode_mcu = encode_mcu_parallel;
+  entropy->pub.finish_pass = finish_pass_parallel;
+}
+
+
+/*
+ * Job run by the application: encode the i'th segment of the batch.
+ * The segment's buffer is large enough that dump_buffer is never called,
+ * and the compressor and the derived tables are only read.
+ */
+
+static void
+encode_segment (void * arg, int i)
+{
+  struct par_encoder * par = (struct par_encoder *) arg;
+  j_compress_ptr cinfo = par->cinfo;
+  JDIMENSION first = (JDIMENSION) i * cinfo->restart_interval;
+  JDIMENSION count = par->MCU_ctr - first;
+  JBLOCKROW blocks, MCU_data[C_MAX_BLOCKS_IN_MCU];
+  working_state state;
+  int blkn, ci;
+
+  if (count > cinfo->restart_interval)
+    count = cinfo->restart_interval;
+  blocks = par->buffer + first * cinfo->blocks_in_MCU;
+
+  state.next_output_byte = par->out + (size_t) i * par->seg_size;
+  state.free_in_buffer = par->seg_size;
+  state.cur.put_buffer = 0;
+  state.cur.put_bits = 0;
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++)
+    state.cur.last_dc_val[ci] = 0;
+  state.cinfo = cinfo;
+
+  for (; count > 0; count--) {
+    for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++)
+      MCU_data[blkn] = blocks++;
+    (void) encode_mcu_blocks(&state, MCU_data);
+  }
+  (void) flush_bits(&state);
+
+  par->seg_len[i] = par->seg_size - state.free_in_buffer;
+}
+
+
+/*
+ * Copy bytes to the destination, emptying its buffer whenever it fills
+ * up as emit_byte does.
+ */
+
+LOCAL(void)
+emit_data (j_compress_ptr cinfo, const JOCTET * data, size_t len)
+{
+  struct jpeg_destination_mgr * dest = cinfo->dest;
+  size_t n;
+
+  while (len > 0) {
+    n = MIN(len, dest->free_in_buffer);
+    MEMCOPY(dest->next_output_byte, data, n);
+    dest->next_output_byte += n;
+    dest->free_in_buffer -= n;
+    data += n;
+    len -= n;
+    if (dest->free_in_buffer == 0)
+      if (! (*dest->empty_output_buffer) (cinfo))
+	ERREXIT(cinfo, JERR_CANT_SUSPEND);
+  }
+}
+
+
+/*
+ * Encode the buffered MCUs and write them out.
+ */
+
+LOCAL(void)
+encode_batch (j_compress_ptr cinfo)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  struct par_encoder * par = entropy->par;
+  JOCTET marker[2];
+  int i, nsegs;
+
+  nsegs = (int) ((par->MCU_ctr + cinfo->restart_interval - 1) /
+		 cinfo->restart_interval);
+  steg_run_jobs(nsegs, encode_segment, (void *) par);
+
+  for (i = 0; i < nsegs; i++) {
+    /* Every segment but the first of the scan follows a restart marker */
+    if (par->segs_done > 0) {
+      marker[0] = (JOCTET) 0xFF;
+      marker[1] = (JOCTET) (JPEG_RST0 + ((par->segs_done - 1) & 7));
+      emit_data(cinfo, marker, 2);
+    }
+    emit_data(cinfo, par->out + (size_t) i * par->seg_size, par->seg_len[i]);
+    par->segs_done++;
+  }
+
+  par->MCU_ctr = 0;
+}
+
+
+/*
+ * Collect one MCU, encoding the batch once it is complete.
+ */
+
+METHODDEF(boolean)
+encode_mcu_parallel (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  struct par_encoder * par = entropy->par;
+  JBLOCKROW blocks;
+  int blkn;
+
+  blocks = par->buffer + (size_t) par->MCU_ctr * cinfo->blocks_in_MCU;
+  for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++)
+    jcopy_block_row(MCU_data[blkn], blocks + blkn, (JDIMENSION) 1);
+
+  if (++par->MCU_ctr == (JDIMENSION) par->batch_segs * cinfo->restart_interval)
+    encode_batch(cinfo);
+
+  return TRUE;
+}
+
+
+/*
+ * Finish up at the end of a scan encoded in parallel.
+ */
+
+METHODDEF(void)
+finish_pass_parallel (j_compress_ptr cinfo)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+
+  if (entropy->par->MCU_ctr > 0)
+    encode_batch(cinfo);
+}
+
+
 /*
  * Huffman coding optimization.
  *
@@ -898,6 +1287,7 @@ jinit_huff_encoder (j_compress_ptr cinfo)
 				SIZEOF(huff_entropy_encoder));
   cinfo->entropy = (struct jpeg_entropy_encoder *) entropy;
   entropy->pub.start_pass = start_pass_huff;
+  entropy->par = NULL;
 
   /* Mark tables unallocated */
   for (i = 0; i < NUM_HUFF_TBLS; i++) {
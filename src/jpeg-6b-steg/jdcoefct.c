@@ -75,7 +75,7 @@ METHODDEF(int) decompress_smooth_data
 	JPP((j_decompress_ptr cinfo, JSAMPIMAGE output_buf));
 #endif
 
-short steg_use_bit (unsigned short temp);
+void steg_use_block (void * ctx, JCOEFPTR block);
 
 LOCAL(void)
 start_iMCU_row (j_decompress_ptr cinfo)
@@ -196,13 +196,9 @@ decompress_onepass (j_decompress_ptr cinfo, JSAMPIMAGE output_buf)
 	      yoffset+yindex < compptr->last_row_height) {
 	    output_col = start_col;
 	    for (xindex = 0; xindex < useful_width; xindex++) {
-	      {
-		/* Retrieve LSB from DCT coefficient */
-		JBLOCKROW block = coef->MCU_buffer[blkn + xindex];
-		int k;
-		for (k = 0; k < DCTSIZE2; k++)
-		  steg_use_bit((JCOEF) (*block)[k]);
-	      }   
+	      /* Retrieve LSBs from DCT coefficients */
+	      steg_use_block(cinfo->client_data,
+			     (JCOEFPTR) coef->MCU_buffer[blkn+xindex]);
 	      (*inverse_DCT) (cinfo, compptr,
 			      (JCOEFPTR) coef->MCU_buffer[blkn+xindex],
 			      output_ptr, output_col);
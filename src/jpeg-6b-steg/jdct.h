@@ -90,6 +90,11 @@ typedef FAST_FLOAT FLOAT_MULT_TYPE; /* preferred floating type */
 #define jpeg_idct_4x4		jRD4x4
 #define jpeg_idct_2x2		jRD2x2
 #define jpeg_idct_1x1		jRD1x1
+#define jsimd_sse2		jSsse2
+#define jsimd_fdct_islow	jSFDislow
+#define jsimd_quant_recip	jSQrecip
+#define jsimd_quantize		jSQuantize
+#define jsimd_idct_islow	jSRDislow
 #endif /* NEED_SHORT_EXTERNAL_NAMES */
 
 /* Extern declarations for the forward and inverse DCT routines. */
@@ -117,6 +122,36 @@ EXTERN(void) jpeg_idct_1x1
     JPP((j_decompress_ptr cinfo, jpeg_component_info * compptr,
 	 JCOEFPTR coef_block, JSAMPARRAY output_buf, JDIMENSION output_col));
 
+/*
+ * SSE2 versions of some of the above, compiled in when the compiler can
+ * generate SSE2 code for the target.  They are used only if jsimd_sse2()
+ * finds the processor to support it, and their results are identical to
+ * those of the C routines.
+ */
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#if BITS_IN_JSAMPLE == 8
+#define JSIMD_SSE2_SUPPORTED
+#endif
+#endif
+
+#ifdef JSIMD_SSE2_SUPPORTED
+EXTERN(boolean) jsimd_sse2 JPP((void));
+
+EXTERN(void) jsimd_fdct_islow JPP((DCTELEM * data));
+
+/* Quantization with reciprocals: recip has DCTSIZE2 entries */
+EXTERN(boolean) jsimd_quant_recip
+    JPP((DCTELEM * divisors, unsigned int * recip));
+EXTERN(boolean) jsimd_quantize
+    JPP((JCOEFPTR coef_block, DCTELEM * divisors, unsigned int * recip,
+	 DCTELEM * workspace));
+
+EXTERN(void) jsimd_idct_islow
+    JPP((j_decompress_ptr cinfo, jpeg_component_info * compptr,
+	 JCOEFPTR coef_block, JSAMPARRAY output_buf, JDIMENSION output_col));
+#endif /* JSIMD_SSE2_SUPPORTED */
+
 
 /*
  * Macros for handling fixed-point arithmetic; these are used by many
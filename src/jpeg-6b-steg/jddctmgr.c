@@ -118,6 +118,10 @@ start_pass (j_decompress_ptr cinfo)
 #ifdef DCT_ISLOW_SUPPORTED
       case JDCT_ISLOW:
 	method_ptr = jpeg_idct_islow;
+#ifdef JSIMD_SSE2_SUPPORTED
+	if (jsimd_sse2())
+	  method_ptr = jsimd_idct_islow;
+#endif
 	method = JDCT_ISLOW;
 	break;
 #endif
@@ -73,10 +73,19 @@ typedef struct {
   /* Whether we care about the DC and AC coefficient values for each block */
   boolean dc_needed[D_MAX_BLOCKS_IN_MCU];
   boolean ac_needed[D_MAX_BLOCKS_IN_MCU];
+
+  /* Restart intervals being decoded in parallel, or NULL */
+  struct par_decoder * par;
 } huff_entropy_decoder;
 
 typedef huff_entropy_decoder * huff_entropy_ptr;
 
+LOCAL(void) start_parallel JPP((j_decompress_ptr cinfo));
+METHODDEF(boolean) decode_mcu JPP((j_decompress_ptr cinfo,
+				   JBLOCKROW *MCU_data));
+METHODDEF(boolean) decode_mcu_parallel JPP((j_decompress_ptr cinfo,
+					    JBLOCKROW *MCU_data));
+
 
 /*
  * Initialize for a Huffman-compressed scan.
@@ -135,6 +144,13 @@ start_pass_huff_decoder (j_decompress_ptr cinfo)
 
   /* Initialize restart counter */
   entropy->restarts_to_go = cinfo->restart_interval;
+
+  /* Independent restart intervals may be decoded in parallel;
+   * an earlier scan may have left the parallel method installed.
+   */
+  entropy->pub.decode_mcu = decode_mcu;
+  entropy->par = NULL;
+  start_parallel(cinfo);
 }
 
 
@@ -228,23 +244,35 @@ jpeg_make_d_derived_tbl (j_decompress_ptr cinfo, boolean isDC, int tblno,
   dtbl->maxcode[17] = 0xFFFFFL; /* ensures jpeg_huff_decode terminates */
 
   /* Compute lookahead tables to speed up decoding.
-   * First we set all the table entries to 0, indicating "too long";
+   * First we set all the table entries to "too long";
    * then we iterate through the Huffman codes that are short enough and
    * fill in all the entries that correspond to bit sequences starting
    * with that code.
    */
 
-  MEMZERO(dtbl->look_nbits, SIZEOF(dtbl->look_nbits));
+  for (i = 0; i < (1<<HUFF_LOOKAHEAD); i++)
+    dtbl->lookup[i] = (HUFF_LOOKAHEAD+1) << 8;
+  MEMZERO(dtbl->look_ac, SIZEOF(dtbl->look_ac));
 
   p = 0;
   for (l = 1; l <= HUFF_LOOKAHEAD; l++) {
     for (i = 1; i <= (int) htbl->bits[l]; i++, p++) {
       /* l = current code's length, p = its index in huffcode[] & huffval[]. */
       /* Generate left-justified code followed by all possible bit sequences */
+      int sym = htbl->huffval[p];
+      int s = sym & 15;
       lookbits = huffcode[p] << (HUFF_LOOKAHEAD-l);
       for (ctr = 1 << (HUFF_LOOKAHEAD-l); ctr > 0; ctr--) {
-	dtbl->look_nbits[lookbits] = l;
-	dtbl->look_sym[lookbits] = htbl->huffval[p];
+	dtbl->lookup[lookbits] = (l << 8) | sym;
+	/* If the magnitude bits of an AC coefficient follow within the
+	 * lookahead window, precompute the coefficient as well.
+	 */
+	if (! isDC && s != 0 && l + s <= HUFF_LOOKAHEAD) {
+	  INT32 v = (lookbits >> (HUFF_LOOKAHEAD - l - s)) & ((1 << s) - 1);
+	  if (v < (((INT32) 1) << (s-1)))
+	    v -= (((INT32) 1) << s) - 1;
+	  dtbl->look_ac[lookbits] = v * 256 + (sym & 0xF0) + l + s;
+	}
 	lookbits++;
       }
     }
@@ -304,6 +332,30 @@ jpeg_fill_bit_buffer (bitread_working_state * state,
   /* We fail to do so only if we hit a marker or are forced to suspend. */
 
   if (cinfo->unread_marker == 0) {	/* cannot advance past a marker */
+#if BIT_BUF_SIZE == 64
+    /* Fast path: if the next 8 bytes hold no 0xFF, there is neither a
+     * stuffed byte nor a marker among them, and we can top up the buffer
+     * with as many whole bytes as fit in a single step.
+     */
+    if (bits_left < MIN_GET_BITS && bytes_in_buffer >= 8) {
+      register bit_buf_type w = 0, t;
+      register int i, n;
+
+      for (i = 0; i < 8; i++)
+	w = (w << 8) | GETJOCTET(next_input_byte[i]);
+      t = ~w;
+      if (((t - 0x0101010101010101UL) & ~t & 0x8080808080808080UL) == 0) {
+	n = (BIT_BUF_SIZE - bits_left) >> 3;
+	if (n == 8)		/* only when bits_left == 0 */
+	  get_buffer = w;
+	else
+	  get_buffer = (get_buffer << (n * 8)) | (w >> (64 - n * 8));
+	bits_left += n * 8;
+	next_input_byte += n;
+	bytes_in_buffer -= n;
+      }
+    }
+#endif
     while (bits_left < MIN_GET_BITS) {
       register int c;
 
@@ -544,6 +596,7 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
       d_derived_tbl * dctbl = entropy->dc_cur_tbls[blkn];
       d_derived_tbl * actbl = entropy->ac_cur_tbls[blkn];
       register int s, k, r;
+      SHIFT_TEMPS
 
       /* Decode a single block's worth of coefficients */
 
@@ -569,6 +622,22 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
 	/* Section F.2.2.2: decode the AC coefficients */
 	/* Since zeroes are skipped, output area must be cleared beforehand */
 	for (k = 1; k < DCTSIZE2; k++) {
+	  /* Fast path: code, run and value in a single table lookup */
+	  if (bits_left < HUFF_LOOKAHEAD) {
+	    if (! jpeg_fill_bit_buffer(&br_state,get_buffer,bits_left, 0))
+	      return FALSE;
+	    get_buffer = br_state.get_buffer; bits_left = br_state.bits_left;
+	  }
+	  if (bits_left >= HUFF_LOOKAHEAD) {
+	    INT32 e = actbl->look_ac[PEEK_BITS(HUFF_LOOKAHEAD)];
+	    if (e != 0) {
+	      DROP_BITS((int) (e & 15));
+	      k += (int) (e & 0xF0) >> 4;
+	      (*block)[jpeg_natural_order[k]] = (JCOEF) RIGHT_SHIFT(e, 8);
+	      continue;
+	    }
+	  }
+
 	  HUFF_DECODE(s, br_state, actbl, return FALSE, label2);
       
 	  r = s >> 4;
@@ -626,6 +695,327 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
 }
 
 
+/*
+ * Parallel decoding of restart intervals.
+ *
+ * A restart marker resets the bit buffer and the DC predictions, so the
+ * entropy-coded segments between markers can be decoded independently.
+ * When the whole scan is already in the source buffer (as with a memory
+ * source), start_pass locates every segment up front.  decode_mcu_parallel
+ * then hands batches of segments to the application's job runner, each
+ * decoded by a private copy of this decoder into a block buffer, and
+ * returns the MCUs from that buffer in their normal order.  The resulting
+ * coefficients are exactly those of the serial decoder.
+ */
+
+/* Provided by the application: worker threads, and a way to use them */
+int steg_threads (void);
+void steg_run_jobs (int njobs, void (*job) (void *, int), void *arg);
+
+#define PAR_SEGS_PER_THREAD	4	/* segments per thread in one batch */
+#define PAR_MAX_BUFFER	((size_t) 64 << 20) /* limit on the block buffer */
+
+typedef struct {
+  const JOCTET * data;		/* entropy-coded data, ending with a marker */
+  size_t len;
+} par_segment;
+
+typedef struct {
+  struct jpeg_decompress_struct cinfo; /* private copy of the decompressor */
+  huff_entropy_decoder entropy;	/* private copy of this decoder */
+  struct jpeg_source_mgr src;	/* reads just one segment */
+  struct jpeg_error_mgr err;	/* keeps the warning count apart */
+} par_worker;
+
+struct par_decoder {
+  j_decompress_ptr cinfo;	/* the real decompressor */
+  par_segment * segs;		/* every restart interval of the scan */
+  JDIMENSION nsegs;
+  JDIMENSION next_seg;		/* first segment of the next batch */
+  int batch_segs;		/* segments decoded per batch */
+  par_worker * workers;		/* one per segment in a batch */
+  JBLOCKROW buffer;		/* blocks of all MCUs in a batch */
+  JDIMENSION total_MCUs;	/* MCUs in the scan */
+  JDIMENSION first_MCU;		/* scan index of the first buffered MCU */
+  JDIMENSION batch_MCUs;	/* MCUs in the buffer */
+  JDIMENSION MCU_ctr;		/* next buffered MCU to return */
+  const JOCTET * end;		/* the marker that terminates the scan */
+};
+
+
+/*
+ * Data source for a worker.  A segment always ends with a marker, which
+ * stops the bit reader, so this is reached only on corrupt data.
+ */
+
+METHODDEF(void)
+init_segment_source (j_decompress_ptr cinfo)
+{
+}
+
+METHODDEF(boolean)
+fill_segment_buffer (j_decompress_ptr cinfo)
+{
+  static const JOCTET fake_eoi[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  cinfo->src->next_input_byte = fake_eoi;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+METHODDEF(void)
+skip_segment_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_source_mgr * src = cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+  if ((size_t) num_bytes > src->bytes_in_buffer)
+    num_bytes = (long) src->bytes_in_buffer;
+  src->next_input_byte += (size_t) num_bytes;
+  src->bytes_in_buffer -= (size_t) num_bytes;
+}
+
+
+/*
+ * Locate the restart intervals of the scan in the source buffer.
+ * Returns FALSE unless exactly the expected number of segments, with
+ * correctly numbered RSTn markers, is followed by another marker.
+ */
+
+LOCAL(boolean)
+find_segments (j_decompress_ptr cinfo, struct par_decoder * par)
+{
+  const JOCTET * start = cinfo->src->next_input_byte;
+  const JOCTET * end = start + cinfo->src->bytes_in_buffer;
+  const JOCTET * p = start;
+  JDIMENSION n = 0;
+  int c;
+
+  for (;;) {
+    p = (const JOCTET *) memchr(p, 0xFF, (size_t) (end - p));
+    if (p == NULL || p + 1 >= end)
+      return FALSE;		/* the scan is not all in memory */
+    c = GETJOCTET(p[1]);
+    if (c == 0) {		/* stuffed zero */
+      p += 2;
+      continue;
+    }
+    if (c == 0xFF) {		/* fill byte */
+      p++;
+      continue;
+    }
+    if (c < JPEG_RST0 || c > JPEG_RST0 + 7)
+      break;
+    if (c != JPEG_RST0 + (int) (n & 7) || n + 1 >= par->nsegs)
+      return FALSE;
+    par->segs[n].data = start;
+    par->segs[n].len = (size_t) (p + 2 - start);
+    n++;
+    start = p += 2;
+  }
+
+  if (n + 1 != par->nsegs)
+    return FALSE;
+  par->segs[n].data = start;
+  par->segs[n].len = (size_t) (p + 2 - start);
+  par->end = p;
+  return TRUE;
+}
+
+
+/*
+ * Set up parallel decoding if it is possible and worthwhile.
+ */
+
+LOCAL(void)
+start_parallel (j_decompress_ptr cinfo)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  struct par_decoder * par;
+  JDIMENSION total_MCUs, nsegs;
+  size_t seg_size;
+  int batch_segs;
+
+  if (cinfo->restart_interval == 0 || cinfo->unread_marker != 0)
+    return;
+  /* The batch buffers are not counted against a memory limit */
+  if (cinfo->mem->max_memory_to_use != 0)
+    return;
+  batch_segs = steg_threads();
+  if (batch_segs <= 1)
+    return;
+
+  if (cinfo->comps_in_scan == 1)
+    total_MCUs = cinfo->cur_comp_info[0]->width_in_blocks *
+      cinfo->cur_comp_info[0]->height_in_blocks;
+  else
+    total_MCUs = cinfo->MCUs_per_row * cinfo->total_iMCU_rows;
+  nsegs = (total_MCUs + cinfo->restart_interval - 1) /
+    cinfo->restart_interval;
+  if (nsegs < 2)
+    return;
+
+  seg_size = (size_t) cinfo->restart_interval * cinfo->blocks_in_MCU *
+    SIZEOF(JBLOCK);
+  batch_segs *= PAR_SEGS_PER_THREAD;
+  if ((JDIMENSION) batch_segs > nsegs)
+    batch_segs = (int) nsegs;
+  if ((size_t) batch_segs > PAR_MAX_BUFFER / seg_size)
+    batch_segs = (int) (PAR_MAX_BUFFER / seg_size);
+  if (batch_segs < 2)
+    return;
+
+  par = (struct par_decoder *)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				SIZEOF(struct par_decoder));
+  par->segs = (par_segment *)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				(size_t) nsegs * SIZEOF(par_segment));
+  par->nsegs = nsegs;
+  if (! find_segments(cinfo, par))
+    return;
+
+  par->workers = (par_worker *)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				(size_t) batch_segs * SIZEOF(par_worker));
+  par->buffer = (JBLOCKROW)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				(size_t) batch_segs * seg_size);
+  par->cinfo = cinfo;
+  par->next_seg = 0;
+  par->batch_segs = batch_segs;
+  par->total_MCUs = total_MCUs;
+  par->first_MCU = par->batch_MCUs = par->MCU_ctr = 0;
+
+  entropy->par = par;
+  entropy->pub.decode_mcu = decode_mcu_parallel;
+}
+
+
+/*
+ * Job run by the application: decode the i'th segment of the batch.
+ */
+
+static void
+decode_segment (void * arg, int i)
+{
+  struct par_decoder * par = (struct par_decoder *) arg;
+  j_decompress_ptr cinfo = &par->workers[i].cinfo;
+  JDIMENSION seg = par->next_seg + (JDIMENSION) i;
+  JDIMENSION first = seg * cinfo->restart_interval;
+  JDIMENSION count = par->total_MCUs - first;
+  JBLOCKROW blocks, MCU_data[D_MAX_BLOCKS_IN_MCU];
+  int blkn;
+
+  if (count > cinfo->restart_interval)
+    count = cinfo->restart_interval;
+  blocks = par->buffer + (first - par->first_MCU) * cinfo->blocks_in_MCU;
+  jzero_far((void FAR *) blocks,
+	    (size_t) count * cinfo->blocks_in_MCU * SIZEOF(JBLOCK));
+
+  for (; count > 0; count--) {
+    for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++)
+      MCU_data[blkn] = blocks++;
+    (void) decode_mcu(cinfo, MCU_data);
+  }
+}
+
+
+/*
+ * Decode the next batch of segments into the block buffer.
+ */
+
+LOCAL(void)
+decode_batch (j_decompress_ptr cinfo)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  struct par_decoder * par = entropy->par;
+  int i, ci, nsegs = par->batch_segs;
+
+  if ((JDIMENSION) nsegs > par->nsegs - par->next_seg)
+    nsegs = (int) (par->nsegs - par->next_seg);
+
+  for (i = 0; i < nsegs; i++) {
+    par_worker * w = &par->workers[i];
+    par_segment * seg = &par->segs[par->next_seg + i];
+
+    MEMCOPY(&w->cinfo, cinfo, SIZEOF(struct jpeg_decompress_struct));
+    MEMCOPY(&w->entropy, entropy, SIZEOF(huff_entropy_decoder));
+    MEMCOPY(&w->err, cinfo->err, SIZEOF(struct jpeg_error_mgr));
+    w->cinfo.err = &w->err;
+    w->cinfo.src = &w->src;
+    w->cinfo.entropy = &w->entropy.pub;
+    w->cinfo.unread_marker = 0;
+    w->err.num_warnings = 0;
+
+    w->src.next_input_byte = seg->data;
+    w->src.bytes_in_buffer = seg->len;
+    w->src.init_source = init_segment_source;
+    w->src.fill_input_buffer = fill_segment_buffer;
+    w->src.skip_input_data = skip_segment_data;
+    w->src.resync_to_restart = cinfo->src->resync_to_restart;
+    w->src.term_source = init_segment_source;
+
+    w->entropy.bitstate.bits_left = 0;
+    w->entropy.bitstate.get_buffer = 0;
+    for (ci = 0; ci < cinfo->comps_in_scan; ci++)
+      w->entropy.saved.last_dc_val[ci] = 0;
+    w->entropy.restarts_to_go = cinfo->restart_interval;
+    w->entropy.pub.insufficient_data = FALSE;
+    w->entropy.par = NULL;
+  }
+
+  par->first_MCU = par->next_seg * cinfo->restart_interval;
+  par->batch_MCUs = (JDIMENSION) nsegs * cinfo->restart_interval;
+  if (par->batch_MCUs > par->total_MCUs - par->first_MCU)
+    par->batch_MCUs = par->total_MCUs - par->first_MCU;
+  par->MCU_ctr = 0;
+
+  steg_run_jobs(nsegs, decode_segment, (void *) par);
+
+  for (i = 0; i < nsegs; i++)
+    cinfo->err->num_warnings += par->workers[i].err.num_warnings;
+  par->next_seg += (JDIMENSION) nsegs;
+}
+
+
+/*
+ * Return one MCU from the block buffer, refilling it as needed.
+ * The caller need not zero MCU_data, but doing so is harmless.
+ */
+
+METHODDEF(boolean)
+decode_mcu_parallel (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  struct par_decoder * par = entropy->par;
+  struct jpeg_source_mgr * src = cinfo->src;
+  JBLOCKROW blocks;
+  int blkn;
+
+  if (par->MCU_ctr >= par->batch_MCUs) {
+    if (par->next_seg >= par->nsegs)
+      return TRUE;		/* more MCUs than expected; leave zeroes */
+    decode_batch(cinfo);
+  }
+
+  blocks = par->buffer + par->MCU_ctr * cinfo->blocks_in_MCU;
+  for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++)
+    jcopy_block_row(blocks + blkn, MCU_data[blkn], (JDIMENSION) 1);
+  par->MCU_ctr++;
+
+  /* After the last MCU, leave the source at the marker ending the scan */
+  if (par->MCU_ctr == par->batch_MCUs && par->next_seg == par->nsegs) {
+    src->bytes_in_buffer -= (size_t) (par->end - src->next_input_byte);
+    src->next_input_byte = par->end;
+  }
+
+  return TRUE;
+}
+
+
 /*
  * Module initialization routine for Huffman entropy decoding.
  */
@@ -642,6 +1032,7 @@ jinit_huff_decoder (j_decompress_ptr cinfo)
   cinfo->entropy = (struct jpeg_entropy_decoder *) entropy;
   entropy->pub.start_pass = start_pass_huff_decoder;
   entropy->pub.decode_mcu = decode_mcu;
+  entropy->par = NULL;
 
   /* Mark tables unallocated */
   for (i = 0; i < NUM_HUFF_TBLS; i++) {
@@ -21,7 +21,7 @@
 
 /* Derived data constructed for each Huffman table */
 
-#define HUFF_LOOKAHEAD	8	/* # of bits of lookahead */
+#define HUFF_LOOKAHEAD	9	/* # of bits of lookahead */
 
 typedef struct {
   /* Basic tables: (element [0] of each array is unused) */
@@ -36,13 +36,22 @@ typedef struct {
   /* Link to public Huffman table (needed only in jpeg_huff_decode) */
   JHUFF_TBL *pub;
 
-  /* Lookahead tables: indexed by the next HUFF_LOOKAHEAD bits of
+  /* Lookahead table: indexed by the next HUFF_LOOKAHEAD bits of
    * the input data stream.  If the next Huffman code is no more
    * than HUFF_LOOKAHEAD bits long, we can obtain its length and
-   * the corresponding symbol directly from these tables.
+   * the corresponding symbol directly from this table.  Each entry
+   * holds (code length << 8) | symbol; a length of HUFF_LOOKAHEAD+1
+   * means the code is too long for the table.
    */
-  int look_nbits[1<<HUFF_LOOKAHEAD]; /* # bits, or 0 if too long */
-  UINT8 look_sym[1<<HUFF_LOOKAHEAD]; /* symbol, or unused */
+  int lookup[1<<HUFF_LOOKAHEAD];
+
+  /* Combined AC lookahead table, used by the sequential decoder only.
+   * When a code and the magnitude bits that follow it both fit in
+   * HUFF_LOOKAHEAD bits, the entry holds the sign-extended coefficient
+   * value << 8, the zero run << 4 and the total number of bits consumed.
+   * Zero means the slow path must be taken.
+   */
+  INT32 look_ac[1<<HUFF_LOOKAHEAD];
 } d_derived_tbl;
 
 /* Expand a Huffman table definition into the derived format */
@@ -69,13 +78,19 @@ EXTERN(void) jpeg_make_d_derived_tbl
  * necessary.
  */
 
+#if defined(__GNUC__) && defined(__LP64__)
+typedef unsigned long bit_buf_type;	/* type of bit-extraction buffer */
+#define BIT_BUF_SIZE  64	/* size of buffer in bits */
+#else
 typedef INT32 bit_buf_type;	/* type of bit-extraction buffer */
 #define BIT_BUF_SIZE  32	/* size of buffer in bits */
+#endif
 
-/* If long is > 32 bits on your machine, and shifting/masking longs is
- * reasonably fast, making bit_buf_type be long and setting BIT_BUF_SIZE
- * appropriately should be a win.  Unfortunately we can't define the size
- * with something like  #define BIT_BUF_SIZE (sizeof(bit_buf_type)*8)
+/* On LP64 machines long is 64 bits and shifting it is as cheap as shifting
+ * an int, so we use the wider buffer there: it roughly halves the number of
+ * calls to jpeg_fill_bit_buffer, and lets that routine load several bytes
+ * at once when no 0xFF (stuffed byte or marker) is coming up.  We can't
+ * define the size with something like  #define BIT_BUF_SIZE (sizeof(bit_buf_type)*8)
  * because not all machines measure sizeof in 8-bit bytes.
  */
 
@@ -168,8 +183,9 @@ EXTERN(boolean) jpeg_fill_bit_buffer
  * Notes about the HUFF_DECODE macro:
  * 1. Near the end of the data segment, we may fail to get enough bits
  *    for a lookahead.  In that case, we do it the hard way.
- * 2. If the lookahead table contains no entry, the next code must be
- *    more than HUFF_LOOKAHEAD bits long.
+ * 2. If the lookahead table entry has length HUFF_LOOKAHEAD+1, the next
+ *    code must be more than HUFF_LOOKAHEAD bits long; that length is then
+ *    also the right min_bits for jpeg_huff_decode.
  * 3. jpeg_huff_decode returns -1 if forced to suspend.
  */
 
@@ -183,11 +199,10 @@ EXTERN(boolean) jpeg_fill_bit_buffer
     } \
   } \
   look = PEEK_BITS(HUFF_LOOKAHEAD); \
-  if ((nb = htbl->look_nbits[look]) != 0) { \
+  if ((nb = (htbl->lookup[look] >> 8)) <= HUFF_LOOKAHEAD) { \
     DROP_BITS(nb); \
-    result = htbl->look_sym[look]; \
+    result = htbl->lookup[look] & 0xFF; \
   } else { \
-    nb = HUFF_LOOKAHEAD+1; \
 slowlabel: \
     if ((result=jpeg_huff_decode(&state,get_buffer,bits_left,htbl,nb)) < 0) \
 	{ failaction; } \
@@ -0,0 +1,296 @@
+/*
+ * jfdctsse.c
+ *
+ * This file is part of the Independent JPEG Group's software, as modified
+ * for OutGuess.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains an SSE2 version of the slow-but-accurate integer
+ * forward DCT of jfdctint.c, and of the quantization in jcdctmgr.c.
+ *
+ * The DCT follows jfdctint.c step by step.  Four rows (or columns) are
+ * transformed at once, one in each 32-bit lane, so that all intermediate
+ * values have the same width as in the C code and the output is exactly
+ * the same.
+ *
+ * Quantization divides by multiplying with a reciprocal.  For a divisor d
+ * (2 <= d < 2^16) we use m = ceil(2^32 / d); then for every n < 2^16
+ *   floor(n / d) == (n * m) >> 32,
+ * because the error m*d - 2^32 is less than d <= 2^16 and n*(m*d - 2^32)
+ * therefore stays below 2^32.  Blocks with larger values, which cannot
+ * occur with 8-bit samples, are left to the C code.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jdct.h"		/* Private declarations for DCT subsystem */
+
+#ifdef JSIMD_SSE2_SUPPORTED
+
+#include <emmintrin.h>
+
+#define SSE2_TARGET	__attribute__((target("sse2")))
+
+
+/*
+ * This module is specialized to the case DCTSIZE = 8.
+ */
+
+#if DCTSIZE != 8
+  Sorry, this code only copes with 8x8 DCTs. /* deliberate syntax err */
+#endif
+
+
+/* Same scaling and constants as jfdctint.c */
+
+#define CONST_BITS  13
+#define PASS1_BITS  2
+
+#define FIX_0_298631336  ((INT32)  2446)	/* FIX(0.298631336) */
+#define FIX_0_390180644  ((INT32)  3196)	/* FIX(0.390180644) */
+#define FIX_0_541196100  ((INT32)  4433)	/* FIX(0.541196100) */
+#define FIX_0_765366865  ((INT32)  6270)	/* FIX(0.765366865) */
+#define FIX_0_899976223  ((INT32)  7373)	/* FIX(0.899976223) */
+#define FIX_1_175875602  ((INT32)  9633)	/* FIX(1.175875602) */
+#define FIX_1_501321110  ((INT32)  12299)	/* FIX(1.501321110) */
+#define FIX_1_847759065  ((INT32)  15137)	/* FIX(1.847759065) */
+#define FIX_1_961570560  ((INT32)  16069)	/* FIX(1.961570560) */
+#define FIX_2_053119869  ((INT32)  16819)	/* FIX(2.053119869) */
+#define FIX_2_562915447  ((INT32)  20995)	/* FIX(2.562915447) */
+#define FIX_3_072711026  ((INT32)  25172)	/* FIX(3.072711026) */
+
+
+/* Low 32 bits of the product of each lane with a constant */
+
+LOCAL(__m128i) SSE2_TARGET
+mul_const (__m128i a, INT32 c)
+{
+  __m128i cc = _mm_set1_epi32((int) c);
+  __m128i even = _mm_mul_epu32(a, cc);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), cc);
+
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+			    _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+}
+
+#define ADD(a,b)	_mm_add_epi32(a, b)
+#define SUB(a,b)	_mm_sub_epi32(a, b)
+#define MUL(a,c)	mul_const(a, c)
+#define VDESCALE(x,n)	_mm_srai_epi32(_mm_add_epi32(x, \
+					_mm_set1_epi32(1 << ((n)-1))), n)
+
+/* Transposes a 4x4 matrix of 32-bit values held in four registers */
+
+#define TRANSPOSE4(a,b,c,d) \
+  { __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d); \
+    __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d); \
+    a = _mm_unpacklo_epi64(t0, t1); b = _mm_unpackhi_epi64(t0, t1); \
+    c = _mm_unpacklo_epi64(t2, t3); d = _mm_unpackhi_epi64(t2, t3); }
+
+
+/*
+ * One 1-D pass over four rows or columns at once; d[k] holds element k
+ * of each of them.  Pass 1 leaves the results scaled up by PASS1_BITS,
+ * pass 2 removes that scaling, just like jpeg_fdct_islow.
+ */
+
+LOCAL(void) SSE2_TARGET
+fdct_1d (__m128i d[DCTSIZE], int pass)
+{
+  __m128i tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+  __m128i tmp10, tmp11, tmp12, tmp13;
+  __m128i z1, z2, z3, z4, z5;
+
+  tmp0 = ADD(d[0], d[7]);
+  tmp7 = SUB(d[0], d[7]);
+  tmp1 = ADD(d[1], d[6]);
+  tmp6 = SUB(d[1], d[6]);
+  tmp2 = ADD(d[2], d[5]);
+  tmp5 = SUB(d[2], d[5]);
+  tmp3 = ADD(d[3], d[4]);
+  tmp4 = SUB(d[3], d[4]);
+
+  /* Even part */
+
+  tmp10 = ADD(tmp0, tmp3);
+  tmp13 = SUB(tmp0, tmp3);
+  tmp11 = ADD(tmp1, tmp2);
+  tmp12 = SUB(tmp1, tmp2);
+
+  if (pass == 1) {
+    d[0] = _mm_slli_epi32(ADD(tmp10, tmp11), PASS1_BITS);
+    d[4] = _mm_slli_epi32(SUB(tmp10, tmp11), PASS1_BITS);
+  } else {
+    d[0] = VDESCALE(ADD(tmp10, tmp11), PASS1_BITS);
+    d[4] = VDESCALE(SUB(tmp10, tmp11), PASS1_BITS);
+  }
+
+  z1 = MUL(ADD(tmp12, tmp13), FIX_0_541196100);
+  if (pass == 1) {
+    d[2] = VDESCALE(ADD(z1, MUL(tmp13, FIX_0_765366865)),
+		    CONST_BITS-PASS1_BITS);
+    d[6] = VDESCALE(ADD(z1, MUL(tmp12, - FIX_1_847759065)),
+		    CONST_BITS-PASS1_BITS);
+  } else {
+    d[2] = VDESCALE(ADD(z1, MUL(tmp13, FIX_0_765366865)),
+		    CONST_BITS+PASS1_BITS);
+    d[6] = VDESCALE(ADD(z1, MUL(tmp12, - FIX_1_847759065)),
+		    CONST_BITS+PASS1_BITS);
+  }
+
+  /* Odd part */
+
+  z1 = ADD(tmp4, tmp7);
+  z2 = ADD(tmp5, tmp6);
+  z3 = ADD(tmp4, tmp6);
+  z4 = ADD(tmp5, tmp7);
+  z5 = MUL(ADD(z3, z4), FIX_1_175875602);
+
+  tmp4 = MUL(tmp4, FIX_0_298631336);
+  tmp5 = MUL(tmp5, FIX_2_053119869);
+  tmp6 = MUL(tmp6, FIX_3_072711026);
+  tmp7 = MUL(tmp7, FIX_1_501321110);
+  z1 = MUL(z1, - FIX_0_899976223);
+  z2 = MUL(z2, - FIX_2_562915447);
+  z3 = MUL(z3, - FIX_1_961570560);
+  z4 = MUL(z4, - FIX_0_390180644);
+
+  z3 = ADD(z3, z5);
+  z4 = ADD(z4, z5);
+
+  if (pass == 1) {
+    d[7] = VDESCALE(ADD(ADD(tmp4, z1), z3), CONST_BITS-PASS1_BITS);
+    d[5] = VDESCALE(ADD(ADD(tmp5, z2), z4), CONST_BITS-PASS1_BITS);
+    d[3] = VDESCALE(ADD(ADD(tmp6, z2), z3), CONST_BITS-PASS1_BITS);
+    d[1] = VDESCALE(ADD(ADD(tmp7, z1), z4), CONST_BITS-PASS1_BITS);
+  } else {
+    d[7] = VDESCALE(ADD(ADD(tmp4, z1), z3), CONST_BITS+PASS1_BITS);
+    d[5] = VDESCALE(ADD(ADD(tmp5, z2), z4), CONST_BITS+PASS1_BITS);
+    d[3] = VDESCALE(ADD(ADD(tmp6, z2), z3), CONST_BITS+PASS1_BITS);
+    d[1] = VDESCALE(ADD(ADD(tmp7, z1), z4), CONST_BITS+PASS1_BITS);
+  }
+}
+
+
+/*
+ * Perform the forward DCT on one block of samples.
+ */
+
+GLOBAL(void) SSE2_TARGET
+jsimd_fdct_islow (DCTELEM * data)
+{
+  __m128i row[DCTSIZE][2];	/* [row][left or right half] */
+  __m128i d[DCTSIZE];
+  int r, h, k;
+
+  for (r = 0; r < DCTSIZE; r++) {
+    row[r][0] = _mm_loadu_si128((__m128i *) (data + r * DCTSIZE));
+    row[r][1] = _mm_loadu_si128((__m128i *) (data + r * DCTSIZE + 4));
+  }
+
+  /* Pass 1: process rows, four at a time after transposing them. */
+
+  for (r = 0; r < DCTSIZE; r += 4) {
+    for (h = 0; h < 2; h++) {
+      d[h*4+0] = row[r+0][h];
+      d[h*4+1] = row[r+1][h];
+      d[h*4+2] = row[r+2][h];
+      d[h*4+3] = row[r+3][h];
+      TRANSPOSE4(d[h*4+0], d[h*4+1], d[h*4+2], d[h*4+3]);
+    }
+
+    fdct_1d(d, 1);
+
+    for (h = 0; h < 2; h++) {
+      TRANSPOSE4(d[h*4+0], d[h*4+1], d[h*4+2], d[h*4+3]);
+      row[r+0][h] = d[h*4+0];
+      row[r+1][h] = d[h*4+1];
+      row[r+2][h] = d[h*4+2];
+      row[r+3][h] = d[h*4+3];
+    }
+  }
+
+  /* Pass 2: process columns, the rows hold four columns each. */
+
+  for (h = 0; h < 2; h++) {
+    for (k = 0; k < DCTSIZE; k++)
+      d[k] = row[k][h];
+
+    fdct_1d(d, 2);
+
+    for (k = 0; k < DCTSIZE; k++)
+      _mm_storeu_si128((__m128i *) (data + k * DCTSIZE + h * 4), d[k]);
+  }
+}
+
+
+/*
+ * Compute the reciprocals of a table of divisors.  Returns FALSE if they
+ * cannot be used for some divisor; the C code has to do the work then.
+ */
+
+GLOBAL(boolean)
+jsimd_quant_recip (DCTELEM * divisors, unsigned int * recip)
+{
+  int i;
+
+  for (i = 0; i < DCTSIZE2; i++) {
+    if (divisors[i] < 2 || divisors[i] >= 65536)
+      return FALSE;
+    recip[i] = (unsigned int)
+      ((((unsigned long long) 1 << 32) + divisors[i] - 1) / divisors[i]);
+  }
+
+  return TRUE;
+}
+
+
+/*
+ * Quantize one block, the same way as forward_DCT does it in C.
+ * Returns FALSE, without storing anything, if a value is out of range.
+ */
+
+GLOBAL(boolean) SSE2_TARGET
+jsimd_quantize (JCOEFPTR coef_block, DCTELEM * divisors,
+		unsigned int * recip, DCTELEM * workspace)
+{
+  __m128i out[DCTSIZE2 / 4];
+  __m128i over = _mm_setzero_si128();
+  __m128i temp, sign, n, m, even, odd;
+  int i;
+
+  for (i = 0; i < DCTSIZE2 / 4; i++) {
+    temp = _mm_loadu_si128((__m128i *) (workspace + i * 4));
+    m = _mm_loadu_si128((__m128i *) (recip + i * 4));
+
+    /* n = |temp| + divisor/2, for rounding */
+    sign = _mm_srai_epi32(temp, 31);
+    n = _mm_sub_epi32(_mm_xor_si128(temp, sign), sign);
+    n = _mm_add_epi32(n, _mm_srai_epi32(
+	  _mm_loadu_si128((__m128i *) (divisors + i * 4)), 1));
+    over = _mm_or_si128(over, n);
+
+    /* The high half of n * m is the quotient */
+    even = _mm_mul_epu32(n, m);
+    odd = _mm_mul_epu32(_mm_srli_epi64(n, 32), _mm_srli_epi64(m, 32));
+    n = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(3,1,3,1)),
+			   _mm_shuffle_epi32(odd, _MM_SHUFFLE(3,1,3,1)));
+
+    /* Restore the sign */
+    out[i] = _mm_sub_epi32(_mm_xor_si128(n, sign), sign);
+  }
+
+  /* Every n must have been below 2^16 */
+  if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(over, 16),
+					_mm_setzero_si128())) != 0xFFFF)
+    return FALSE;
+
+  for (i = 0; i < DCTSIZE2 / 8; i++)
+    _mm_storeu_si128((__m128i *) (coef_block + i * 8),
+		     _mm_packs_epi32(out[i*2], out[i*2+1]));
+
+  return TRUE;
+}
+
+#endif /* JSIMD_SSE2_SUPPORTED */
@@ -0,0 +1,290 @@
+/*
+ * jidctsse.c
+ *
+ * This file is part of the Independent JPEG Group's software, as modified
+ * for OutGuess.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains an SSE2 version of the slow-but-accurate integer
+ * inverse DCT of jidctint.c.
+ *
+ * It follows jidctint.c step by step, four columns (or rows) at a time in
+ * 32-bit lanes, and gives exactly the same output.  The C code keeps its
+ * products in INT32, which may be wider than 32 bits; so that no lane can
+ * overflow, blocks whose dequantized coefficients or intermediate values
+ * reach 2^14 are handed to jpeg_idct_islow.  Such values do not come out
+ * of the compression of 8-bit samples.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jdct.h"		/* Private declarations for DCT subsystem */
+
+#ifdef JSIMD_SSE2_SUPPORTED
+
+#include <emmintrin.h>
+
+#define SSE2_TARGET	__attribute__((target("sse2")))
+
+
+/*
+ * This module is specialized to the case DCTSIZE = 8.
+ */
+
+#if DCTSIZE != 8
+  Sorry, this code only copes with 8x8 DCTs. /* deliberate syntax err */
+#endif
+
+
+/* Same scaling and constants as jidctint.c */
+
+#define CONST_BITS  13
+#define PASS1_BITS  2
+
+#define FIX_0_298631336  ((INT32)  2446)	/* FIX(0.298631336) */
+#define FIX_0_390180644  ((INT32)  3196)	/* FIX(0.390180644) */
+#define FIX_0_541196100  ((INT32)  4433)	/* FIX(0.541196100) */
+#define FIX_0_765366865  ((INT32)  6270)	/* FIX(0.765366865) */
+#define FIX_0_899976223  ((INT32)  7373)	/* FIX(0.899976223) */
+#define FIX_1_175875602  ((INT32)  9633)	/* FIX(1.175875602) */
+#define FIX_1_501321110  ((INT32)  12299)	/* FIX(1.501321110) */
+#define FIX_1_847759065  ((INT32)  15137)	/* FIX(1.847759065) */
+#define FIX_1_961570560  ((INT32)  16069)	/* FIX(1.961570560) */
+#define FIX_2_053119869  ((INT32)  16819)	/* FIX(2.053119869) */
+#define FIX_2_562915447  ((INT32)  20995)	/* FIX(2.562915447) */
+#define FIX_3_072711026  ((INT32)  25172)	/* FIX(3.072711026) */
+
+/* Values must stay below this for the lanes not to overflow */
+#define SAFE_BITS   14
+
+
+/* Low 32 bits of the lane by lane product of two registers */
+
+LOCAL(__m128i) SSE2_TARGET
+mul_lanes (__m128i a, __m128i b)
+{
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+			    _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+}
+
+#define ADD(a,b)	_mm_add_epi32(a, b)
+#define SUB(a,b)	_mm_sub_epi32(a, b)
+#define MUL(a,c)	mul_lanes(a, _mm_set1_epi32((int) (c)))
+#define VDESCALE(x,n)	_mm_srai_epi32(_mm_add_epi32(x, \
+					_mm_set1_epi32(1 << ((n)-1))), n)
+
+/* Transposes a 4x4 matrix of 32-bit values held in four registers */
+
+#define TRANSPOSE4(a,b,c,d) \
+  { __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d); \
+    __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d); \
+    a = _mm_unpacklo_epi64(t0, t1); b = _mm_unpackhi_epi64(t0, t1); \
+    c = _mm_unpacklo_epi64(t2, t3); d = _mm_unpackhi_epi64(t2, t3); }
+
+/* ORs the absolute value of each lane into acc */
+
+#define ACCUMULATE_ABS(acc,x) \
+  { __m128i s = _mm_srai_epi32(x, 31); \
+    acc = _mm_or_si128(acc, _mm_sub_epi32(_mm_xor_si128(x, s), s)); }
+
+/* TRUE if all lanes of acc are below 2^SAFE_BITS */
+
+#define IS_SAFE(acc) \
+  (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(acc, SAFE_BITS), \
+				     _mm_setzero_si128())) == 0xFFFF)
+
+
+/*
+ * One 1-D pass over four columns or rows at once; d[k] holds element k
+ * of each of them.  The results are descaled by the given number of bits.
+ */
+
+LOCAL(void) SSE2_TARGET
+idct_1d (__m128i d[DCTSIZE], int shift)
+{
+  __m128i tmp0, tmp1, tmp2, tmp3;
+  __m128i tmp10, tmp11, tmp12, tmp13;
+  __m128i z1, z2, z3, z4, z5;
+
+  /* Even part: reverse the even part of the forward DCT. */
+  /* The rotator is sqrt(2)*c(-6). */
+
+  z2 = d[2];
+  z3 = d[6];
+
+  z1 = MUL(ADD(z2, z3), FIX_0_541196100);
+  tmp2 = ADD(z1, MUL(z3, - FIX_1_847759065));
+  tmp3 = ADD(z1, MUL(z2, FIX_0_765366865));
+
+  tmp0 = _mm_slli_epi32(ADD(d[0], d[4]), CONST_BITS);
+  tmp1 = _mm_slli_epi32(SUB(d[0], d[4]), CONST_BITS);
+
+  tmp10 = ADD(tmp0, tmp3);
+  tmp13 = SUB(tmp0, tmp3);
+  tmp11 = ADD(tmp1, tmp2);
+  tmp12 = SUB(tmp1, tmp2);
+
+  /* Odd part per figure 8 of jidctint.c */
+
+  tmp0 = d[7];
+  tmp1 = d[5];
+  tmp2 = d[3];
+  tmp3 = d[1];
+
+  z1 = ADD(tmp0, tmp3);
+  z2 = ADD(tmp1, tmp2);
+  z3 = ADD(tmp0, tmp2);
+  z4 = ADD(tmp1, tmp3);
+  z5 = MUL(ADD(z3, z4), FIX_1_175875602);
+
+  tmp0 = MUL(tmp0, FIX_0_298631336);
+  tmp1 = MUL(tmp1, FIX_2_053119869);
+  tmp2 = MUL(tmp2, FIX_3_072711026);
+  tmp3 = MUL(tmp3, FIX_1_501321110);
+  z1 = MUL(z1, - FIX_0_899976223);
+  z2 = MUL(z2, - FIX_2_562915447);
+  z3 = MUL(z3, - FIX_1_961570560);
+  z4 = MUL(z4, - FIX_0_390180644);
+
+  z3 = ADD(z3, z5);
+  z4 = ADD(z4, z5);
+
+  tmp0 = ADD(tmp0, ADD(z1, z3));
+  tmp1 = ADD(tmp1, ADD(z2, z4));
+  tmp2 = ADD(tmp2, ADD(z2, z3));
+  tmp3 = ADD(tmp3, ADD(z1, z4));
+
+  /* Final output stage: inputs are tmp10..tmp13, tmp0..tmp3 */
+
+  d[0] = VDESCALE(ADD(tmp10, tmp3), shift);
+  d[7] = VDESCALE(SUB(tmp10, tmp3), shift);
+  d[1] = VDESCALE(ADD(tmp11, tmp2), shift);
+  d[6] = VDESCALE(SUB(tmp11, tmp2), shift);
+  d[2] = VDESCALE(ADD(tmp12, tmp1), shift);
+  d[5] = VDESCALE(SUB(tmp12, tmp1), shift);
+  d[3] = VDESCALE(ADD(tmp13, tmp0), shift);
+  d[4] = VDESCALE(SUB(tmp13, tmp0), shift);
+}
+
+
+/*
+ * Does the work of range_limit[x & RANGE_MASK] for the eight values of
+ * an output row: x is offset by CENTERJSAMPLE and wrapped to the table
+ * size, where the top part of the table maps to 0 and the rest saturates.
+ */
+
+LOCAL(__m128i) SSE2_TARGET
+range_limit_row (__m128i lo, __m128i hi)
+{
+  const __m128i center = _mm_set1_epi32(CENTERJSAMPLE);
+  const __m128i mask = _mm_set1_epi32(RANGE_MASK);
+  const __m128i zero_from = _mm_set1_epi32(2 * (MAXJSAMPLE+1) +
+					   CENTERJSAMPLE - 1);
+  const __m128i wrap = _mm_set1_epi32(RANGE_MASK + 1);
+
+  lo = _mm_and_si128(ADD(lo, center), mask);
+  hi = _mm_and_si128(ADD(hi, center), mask);
+  lo = SUB(lo, _mm_and_si128(_mm_cmpgt_epi32(lo, zero_from), wrap));
+  hi = SUB(hi, _mm_and_si128(_mm_cmpgt_epi32(hi, zero_from), wrap));
+
+  return _mm_packs_epi32(lo, hi);
+}
+
+
+/*
+ * Perform dequantization and inverse DCT on one block of coefficients.
+ */
+
+GLOBAL(void) SSE2_TARGET
+jsimd_idct_islow (j_decompress_ptr cinfo, jpeg_component_info * compptr,
+		  JCOEFPTR coef_block,
+		  JSAMPARRAY output_buf, JDIMENSION output_col)
+{
+  ISLOW_MULT_TYPE * quantptr = (ISLOW_MULT_TYPE *) compptr->dct_table;
+  __m128i ws[DCTSIZE][2];	/* [row][left or right half] */
+  __m128i d[DCTSIZE];
+  __m128i acc = _mm_setzero_si128();
+  __m128i coef, q[2], rows[4];
+  int r, h, k;
+
+  /* Dequantize */
+
+  for (r = 0; r < DCTSIZE; r++) {
+    coef = _mm_loadu_si128((__m128i *) (coef_block + r * DCTSIZE));
+    if (SIZEOF(ISLOW_MULT_TYPE) == 4) {
+      q[0] = _mm_loadu_si128((__m128i *) (quantptr + r * DCTSIZE));
+      q[1] = _mm_loadu_si128((__m128i *) (quantptr + r * DCTSIZE + 4));
+    } else {
+      q[1] = _mm_loadu_si128((__m128i *) (quantptr + r * DCTSIZE));
+      q[0] = _mm_srai_epi32(_mm_unpacklo_epi16(q[1], q[1]), 16);
+      q[1] = _mm_srai_epi32(_mm_unpackhi_epi16(q[1], q[1]), 16);
+    }
+    ws[r][0] = mul_lanes(_mm_srai_epi32(_mm_unpacklo_epi16(coef, coef), 16),
+			 q[0]);
+    ws[r][1] = mul_lanes(_mm_srai_epi32(_mm_unpackhi_epi16(coef, coef), 16),
+			 q[1]);
+    ACCUMULATE_ABS(acc, ws[r][0]);
+    ACCUMULATE_ABS(acc, ws[r][1]);
+  }
+  if (! IS_SAFE(acc)) {
+    jpeg_idct_islow(cinfo, compptr, coef_block, output_buf, output_col);
+    return;
+  }
+
+  /* Pass 1: process columns, the rows hold four columns each. */
+  /* Results are scaled up by sqrt(8) and by 2**PASS1_BITS. */
+
+  acc = _mm_setzero_si128();
+  for (h = 0; h < 2; h++) {
+    for (k = 0; k < DCTSIZE; k++)
+      d[k] = ws[k][h];
+
+    idct_1d(d, CONST_BITS-PASS1_BITS);
+
+    for (k = 0; k < DCTSIZE; k++) {
+      ws[k][h] = d[k];
+      ACCUMULATE_ABS(acc, d[k]);
+    }
+  }
+  if (! IS_SAFE(acc)) {
+    jpeg_idct_islow(cinfo, compptr, coef_block, output_buf, output_col);
+    return;
+  }
+
+  /* Pass 2: process rows, four at a time after transposing them. */
+  /* The results are descaled by 8 and by 2**PASS1_BITS. */
+
+  for (r = 0; r < DCTSIZE; r += 4) {
+    for (h = 0; h < 2; h++) {
+      d[h*4+0] = ws[r+0][h];
+      d[h*4+1] = ws[r+1][h];
+      d[h*4+2] = ws[r+2][h];
+      d[h*4+3] = ws[r+3][h];
+      TRANSPOSE4(d[h*4+0], d[h*4+1], d[h*4+2], d[h*4+3]);
+    }
+
+    idct_1d(d, CONST_BITS+PASS1_BITS+3);
+
+    TRANSPOSE4(d[0], d[1], d[2], d[3]);
+    TRANSPOSE4(d[4], d[5], d[6], d[7]);
+
+    /* d[k] and d[k+4] now hold the left and right half of row r+k */
+    for (k = 0; k < 4; k++)
+      rows[k] = range_limit_row(d[k], d[k+4]);
+    rows[0] = _mm_packus_epi16(rows[0], rows[1]);
+    rows[2] = _mm_packus_epi16(rows[2], rows[3]);
+
+    _mm_storel_epi64((__m128i *) (output_buf[r+0] + output_col), rows[0]);
+    _mm_storel_epi64((__m128i *) (output_buf[r+1] + output_col),
+		     _mm_srli_si128(rows[0], 8));
+    _mm_storel_epi64((__m128i *) (output_buf[r+2] + output_col), rows[2]);
+    _mm_storel_epi64((__m128i *) (output_buf[r+3] + output_col),
+		     _mm_srli_si128(rows[2], 8));
+  }
+}
+
+#endif /* JSIMD_SSE2_SUPPORTED */
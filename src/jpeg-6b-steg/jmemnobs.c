@@ -7,12 +7,15 @@
  *
  * This file provides a really simple implementation of the system-
  * dependent portion of the JPEG memory manager.  This implementation
- * assumes that no backing-store files are needed: all required space
- * can be obtained from malloc().
- * This is very portable in the sense that it'll compile on almost anything,
- * but you'd better have lots of main memory (or virtual memory) if you want
- * to process big images.
- * Note that the max_memory_to_use option is ignored by this implementation.
+ * assumes that no backing-store files are needed as long as
+ * max_memory_to_use is left at zero: all required space can be obtained
+ * from malloc().  When the application sets a limit, big virtual arrays
+ * go to temporary files in $TMPDIR, created with mkstemp().
+ *
+ * Large objects that are freed are kept for reuse by the next JPEG object
+ * that asks for about as much, so that a process that handles one image
+ * after the other does not have to fault in fresh pages for its
+ * whole-image arrays every time.
  */
 
 #define JPEG_INTERNALS
@@ -23,8 +26,19 @@
 #ifndef HAVE_STDLIB_H		/* <stdlib.h> should declare malloc(),free() */
 extern void * malloc JPP((size_t size));
 extern void free JPP((void *ptr));
+extern char * getenv JPP((const char * name));
+#endif
+#ifndef NO_MKSTEMP
+#include <unistd.h>		/* to declare unlink() */
+extern int mkstemp JPP((char * templ));
 #endif
 
+#ifndef TEMP_DIRECTORY		/* can override from jconfig.h or Makefile */
+#define TEMP_DIRECTORY  "/tmp"	/* used when $TMPDIR is not set */
+#endif
+
+#define RW_BINARY	"w+b"	/* fdopen() mode for the temporary files */
+
 
 /*
  * Memory allocation and freeing are controlled by the regular library
@@ -45,49 +59,191 @@ jpeg_free_small (j_common_ptr cinfo, void * object, size_t sizeofobject)
 
 
 /*
- * "Large" objects are treated the same as "small" ones.
+ * "Large" objects come from malloc() as well, but big ones are recycled.
+ * Only these are worth it: the small pools are a few KB of bookkeeping
+ * per object, while the large ones hold the coefficient and sample
+ * arrays whose size scales with the image.  Every large object is
+ * preceded by a header with its actual size, as it may have come from
+ * the cache with more space than was asked for.
  * NB: although we include FAR keywords in the routine declarations,
  * this file won't actually work in 80x86 small/medium model; at least,
  * you probably won't be able to process useful-size images in only 64KB.
  */
 
+#define CACHE_MIN_SIZE	((size_t) 65536)  /* smaller objects go to free() */
+#define CACHE_MAX_TOTAL	((size_t) 256 << 20) /* bytes kept at most */
+#define CACHE_SLOTS	32
+
+typedef union {
+  size_t size;			/* bytes after the header */
+  long double align;		/* keeps the object aligned like malloc's */
+} large_hdr;
+
+static struct {
+  large_hdr * hdr;
+  size_t size;
+} cache[CACHE_SLOTS];
+static size_t cache_total;
+
+/* The cache is shared by the JPEG objects of all threads */
+#ifdef __GNUC__
+static volatile int cache_lock;
+#define LOCK_CACHE()	while (__sync_lock_test_and_set(&cache_lock, 1))
+#define UNLOCK_CACHE()	__sync_lock_release(&cache_lock)
+#define CACHE_SUPPORTED
+#endif
+
 GLOBAL(void FAR *)
 jpeg_get_large (j_common_ptr cinfo, size_t sizeofobject)
 {
-  return (void FAR *) malloc(sizeofobject);
+  large_hdr * hdr = NULL;
+#ifdef CACHE_SUPPORTED
+  int i, best = -1;
+
+  /* Take the smallest cached object that wastes at most a quarter */
+  if (sizeofobject >= CACHE_MIN_SIZE) {
+    LOCK_CACHE();
+    for (i = 0; i < CACHE_SLOTS; i++)
+      if (cache[i].hdr != NULL && cache[i].size >= sizeofobject &&
+	  cache[i].size - sizeofobject <= sizeofobject / 4 &&
+	  (best < 0 || cache[i].size < cache[best].size))
+	best = i;
+    if (best >= 0) {
+      hdr = cache[best].hdr;
+      cache_total -= cache[best].size;
+      cache[best].hdr = NULL;
+    }
+    UNLOCK_CACHE();
+  }
+#endif
+
+  if (hdr == NULL) {
+    hdr = (large_hdr *) malloc(SIZEOF(large_hdr) + sizeofobject);
+    if (hdr == NULL)
+      return NULL;
+    hdr->size = sizeofobject;
+  }
+  return (void FAR *) (hdr + 1);
 }
 
 GLOBAL(void)
 jpeg_free_large (j_common_ptr cinfo, void FAR * object, size_t sizeofobject)
 {
-  free(object);
+  large_hdr * hdr = (large_hdr *) object - 1;
+#ifdef CACHE_SUPPORTED
+  int i;
+
+  /* Under a memory limit, freed objects must really go away */
+  if (hdr->size >= CACHE_MIN_SIZE && cinfo->mem->max_memory_to_use == 0) {
+    LOCK_CACHE();
+    if (cache_total + hdr->size <= CACHE_MAX_TOTAL)
+      for (i = 0; i < CACHE_SLOTS; i++)
+	if (cache[i].hdr == NULL) {
+	  cache[i].hdr = hdr;
+	  cache[i].size = hdr->size;
+	  cache_total += hdr->size;
+	  hdr = NULL;
+	  break;
+	}
+    UNLOCK_CACHE();
+  }
+#endif
+
+  free(hdr);
 }
 
 
 /*
  * This routine computes the total memory space available for allocation.
- * Here we always say, "we got all you want bud!"
+ * Without a limit we always say, "we got all you want bud!"
  */
 
 GLOBAL(long)
 jpeg_mem_available (j_common_ptr cinfo, long min_bytes_needed,
 		    long max_bytes_needed, long already_allocated)
 {
-  return max_bytes_needed;
+  if (cinfo->mem->max_memory_to_use == 0)
+    return max_bytes_needed;
+  return cinfo->mem->max_memory_to_use - already_allocated;
 }
 
 
 /*
  * Backing store (temporary file) management.
- * Since jpeg_mem_available always promised the moon,
- * this should never be called and we can just error out.
+ * This is only called when a limit is set; the file is read and written
+ * with stdio, as in jmemansi.c.
  */
 
+#ifndef NO_MKSTEMP
+
+METHODDEF(void)
+read_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+		    void FAR * buffer_address,
+		    long file_offset, long byte_count)
+{
+  if (fseek(info->temp_file, file_offset, SEEK_SET))
+    ERREXIT(cinfo, JERR_TFILE_SEEK);
+  if (JFREAD(info->temp_file, buffer_address, byte_count)
+      != (size_t) byte_count)
+    ERREXIT(cinfo, JERR_TFILE_READ);
+}
+
+
+METHODDEF(void)
+write_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+		     void FAR * buffer_address,
+		     long file_offset, long byte_count)
+{
+  if (fseek(info->temp_file, file_offset, SEEK_SET))
+    ERREXIT(cinfo, JERR_TFILE_SEEK);
+  if (JFWRITE(info->temp_file, buffer_address, byte_count)
+      != (size_t) byte_count)
+    ERREXIT(cinfo, JERR_TFILE_WRITE);
+}
+
+
+METHODDEF(void)
+close_backing_store (j_common_ptr cinfo, backing_store_ptr info)
+{
+  fclose(info->temp_file);
+  /* The file was unlinked as soon as it was opened */
+}
+
+#endif /* NO_MKSTEMP */
+
+
 GLOBAL(void)
 jpeg_open_backing_store (j_common_ptr cinfo, backing_store_ptr info,
 			 long total_bytes_needed)
 {
+#ifndef NO_MKSTEMP
+  char path[1024];
+  const char * dir;
+  int fd;
+
+  dir = TEMP_DIRECTORY;
+#ifndef NO_GETENV
+  if (getenv("TMPDIR") != NULL && *getenv("TMPDIR") != '\0')
+    dir = getenv("TMPDIR");
+#endif
+  if (strlen(dir) + 16 > SIZEOF(path))
+    ERREXITS(cinfo, JERR_TFILE_CREATE, dir);
+  strcpy(path, dir);
+  strcat(path, "/jpegXXXXXX");
+  if ((fd = mkstemp(path)) < 0)
+    ERREXITS(cinfo, JERR_TFILE_CREATE, path);
+  if ((info->temp_file = fdopen(fd, RW_BINARY)) == NULL) {
+    close(fd);
+    unlink(path);
+    ERREXITS(cinfo, JERR_TFILE_CREATE, path);
+  }
+  unlink(path);
+  info->read_backing_store = read_backing_store;
+  info->write_backing_store = write_backing_store;
+  info->close_backing_store = close_backing_store;
+#else
   ERREXIT(cinfo, JERR_NO_BACKING_STORE);
+#endif
 }
 
 
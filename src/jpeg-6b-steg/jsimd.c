@@ -0,0 +1,38 @@
+/*
+ * jsimd.c
+ *
+ * This file is part of the Independent JPEG Group's software, as modified
+ * for OutGuess.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file decides at run time whether the SSE2 versions of the DCT
+ * routines may be used.  Setting the environment variable JSIMD_FORCENONE
+ * to 1 disables them, which is useful to compare against the C code.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jdct.h"		/* Private declarations for DCT subsystem */
+
+#ifdef JSIMD_SSE2_SUPPORTED
+
+#include <stdlib.h>		/* getenv() */
+
+GLOBAL(boolean)
+jsimd_sse2 (void)
+{
+  static int have_sse2 = -1;	/* not checked yet */
+  char * env;
+
+  if (have_sse2 < 0) {
+    __builtin_cpu_init();
+    have_sse2 = __builtin_cpu_supports("sse2") ? 1 : 0;
+    if ((env = getenv("JSIMD_FORCENONE")) != NULL && strcmp(env, "1") == 0)
+      have_sse2 = 0;
+  }
+
+  return have_sse2 ? TRUE : FALSE;
+}
+
+#endif /* JSIMD_SSE2_SUPPORTED */
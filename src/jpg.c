@@ -37,20 +37,29 @@
  */
 
 #include <sys/types.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 
 #include "config.h"
 #include "outguess.h"
 #include "pnm.h"
+#define JPEG_INTERNALS		/* we replace encode_mcu and decompress_data */
 #include "jpeg-6b-steg/jpeglib.h"
 #include "jpg.h"
+#include "jobs.h"
+#include "spill.h"
 
 #include "jpeg-6b-steg/jmorecfg.h"
 
 void jpeg_dummy_dest (j_compress_ptr cinfo);
+void jpeg_mem_src (j_decompress_ptr cinfo, const u_char *data, size_t len);
+void jpeg_mem_dest (j_compress_ptr cinfo, u_char **data, size_t *len);
 
 /* The functions that can be used to handle a JPEG data object */
 
@@ -60,61 +69,135 @@ handler jpg_handler = {
 	init_JPEG_handler,
 	read_JPEG_file,
 	write_JPEG_file,
+	read_JPEG_mem,
+	write_JPEG_mem,
 	bitmap_from_jpg,
 	bitmap_to_jpg,
 	preserve_jpg
 };
 
-static int jpeg_state;
-static bitmap tbitmap;
-static u_int32_t off;
 static int quality = 75;
-static int jpeg_eval;
-static int eval_cnt;
-
-static int dctmin;
-static int dctmax;
+static int optimize = 0;		/* optimized Huffman tables on output */
+static int restart = 0;			/* restart marker every MCU row */
 
 extern int steg_foil;		/* Statistics keps in main program */
 extern int steg_foilfail;
 
 #define DCTMIN		100
 #define DCTENTRIES	256
-static int dctadjust[DCTENTRIES];
+#define DCTINDEX(x)	((x) + 128)	/* entry of a coefficient value */
 
 #define DCTFREQRANGE	5000	/* Number of bits for which the below holds */
 #define DCTFREQREDUCE	33	/* Threshold is /REDUCE, 1% for 100 */
 #define DCTFREQMIN	2	/* At least 5 coeff in cache */
-static int dctfreq[DCTENTRIES];
-static int dctpending;
 
-void
-init_state(int state, int eval, bitmap *bitmap)
-{
-	jpeg_state = state;
-	jpeg_eval = eval;
-	eval_cnt = 0;
-
-	dctmin = 127;
-	dctmax = -127;
-
-	off = 0;
-	if (state == JPEG_READING) {
-		memset(&tbitmap, 0, sizeof(tbitmap));
-		tbitmap.bytes = 256;
-		tbitmap.bits = tbitmap.bytes * 8;
-		tbitmap.bitmap = checkedmalloc(tbitmap.bytes);
-		tbitmap.locked = checkedmalloc(tbitmap.bytes);
-		memset(tbitmap.locked, 0, tbitmap.bytes);
-		tbitmap.data = checkedmalloc(tbitmap.bits);
-	} else if (bitmap) {
-		memcpy(&tbitmap, bitmap, sizeof(tbitmap));
+/*
+ * State of one pass of steg_use_block over the coefficients of an image.
+ * The hooks in the JPEG library find it in client_data, so that several
+ * images can be processed at the same time.
+ */
+
+typedef struct _jpgsteg {
+	int state;		/* JPEG_READING, JPEG_WRITING or JPEG_CAPTURING */
+	int eval;		/* print the coefficients */
+	int eval_cnt;
+	bitmap tbitmap;
+	u_int32_t off;		/* next bit in tbitmap */
+	struct _jpgcoeffs *coeffs; /* arrays filled by capture_mcu */
+} jpgsteg;
+
+/* State of the statistics correction, kept with the bitmap */
+
+typedef struct _jpgfoil {
+	int eval;
+	int dctadjust[DCTENTRIES];
+	int dctfreq[DCTENTRIES];
+	int dctpending;
+} jpgfoil;
+
+/*
+ * A JPEG image that is kept as quantized DCT coefficients.  The virtual
+ * block arrays belong either to the decompression object that read them
+ * from a JPEG or to the compression object that computed them from
+ * pixels, and stay valid until that object is destroyed.
+ */
+
+typedef struct _jpgcoeffs {
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	j_common_ptr owner;		/* object that owns the arrays */
+	jpeg_component_info *comp_info;
+	int num_components;
+	jvirt_barray_ptr *arrays;	/* one per component */
+	JDIMENSION mcus_per_row;	/* geometry of an interleaved scan */
+	JDIMENSION mcu_rows;
+
+	JDIMENSION mcu_ctr;		/* MCUs received from the compressor */
+	JDIMENSION mcu_row0;		/* MCU row of the image it starts at */
+	JBLOCKARRAY rows[MAX_COMPONENTS]; /* iMCU row being filled */
+	JBLOCKARRAY image_rows[MAX_COMPONENTS]; /* all rows, if accessed */
+} jpgcoeffs;
+
+static void
+init_state(jpgsteg *js, int state, int eval, bitmap *bitmap)
+{
+	memset(js, 0, sizeof(*js));
+
+	js->state = state;
+	js->eval = eval;
+
+	/* When reading, size_state allocates the bitmap */
+	if (state != JPEG_READING && bitmap)
+		memcpy(&js->tbitmap, bitmap, sizeof(js->tbitmap));
+}
+
+/*
+ * Allocates the bitmap for reading.  Every coefficient of the image
+ * might carry a bit, the unused space is released by finish_state.
+ */
+
+static void
+size_state(jpgsteg *js, jpeg_component_info *compptr, int ncomps)
+{
+	bitmap *tbitmap = &js->tbitmap;
+	size_t bits = 0;
+	int ci;
+
+	for (ci = 0; ci < ncomps; ci++, compptr++)
+		bits += (size_t)compptr->width_in_blocks *
+			compptr->height_in_blocks * DCTSIZE2;
+
+	if (bits > INT_MAX - 7) {
+		fprintf(stderr, "size_state: image too large\n");
+		exit(1);
 	}
+
+	tbitmap->bits = bits;
+	tbitmap->bytes = (bits + 7) / 8;
+	tbitmap->bitmap = checkedmalloc(tbitmap->bytes);
+	tbitmap->locked = checkedmalloc(tbitmap->bytes);
+	memset(tbitmap->locked, 0, tbitmap->bytes);
+	tbitmap->data = spill_alloc(tbitmap->bits);
+}
+
+/* Shrinks a buffer to the part that was used */
+
+static void *
+trim_state(void *buf, size_t size)
+{
+	void *p;
+
+	if ((p = realloc(buf, size ? size : 1)) == NULL)
+		return (buf);
+
+	return (p);
 }
 
 int
 preserve_single(bitmap *bitmap, int off, char coeff)
 {
+	jpgfoil *foil = bitmap->priv;
 	int i;
 	char *data = bitmap->data;
 	char *pbits = bitmap->bitmap;
@@ -138,7 +221,7 @@ preserve_single(bitmap *bitmap, int off, char coeff)
 
 			WRITE_BIT(pmetalock, i, 1);
 
-			if (jpeg_eval)
+			if (foil->eval)
 				fprintf(stderr,
 					"off: %d, i: %d, coeff: %d, data: %d\n",
 					off, i, coeff, data[i]);
@@ -154,47 +237,60 @@ preserve_single(bitmap *bitmap, int off, char coeff)
 int
 preserve_jpg(bitmap *bitmap, int off)
 {
+	jpgfoil *foil = bitmap->priv;
 	char coeff;
 	char *data = bitmap->data;
 
 	if (off == -1) {
 		int res;
 
-		if (jpeg_eval)
+		if (foil == NULL) {
+			foil = checkedmalloc(sizeof(*foil));
+			bitmap->priv = foil;
+		}
+		memset(foil, 0, sizeof(*foil));
+		foil->eval = steg_stat >= 3 ? 1 : 0;
+
+		if (foil->eval) {
+			int dctmin = 127, dctmax = -127;
+
+			for (int i = 0; i < bitmap->bits; i++) {
+				if (data[i] < dctmin)
+					dctmin = data[i];
+				if (data[i] > dctmax)
+					dctmax = data[i];
+			}
 			fprintf(stderr, "DCT: %d<->%d\n", dctmin, dctmax);
+		}
 
 		bitmap->preserve = preserve_jpg;
 		memset(bitmap->metalock, 0, bitmap->bytes);
 
-		memset(dctadjust, 0, sizeof(dctadjust));
-		memset(dctfreq, 0, sizeof(dctfreq));
-		dctpending = 0;
-
 		/* Calculate coefficent frequencies */
 		for (int i = 0; i < bitmap->bits; i++) {
-			dctfreq[data[i] + 127]++;
+			foil->dctfreq[DCTINDEX(data[i])]++;
 		}
 
-		int a = dctfreq[-1 + 127];
-		int b = dctfreq[-2 + 127];
+		int a = foil->dctfreq[DCTINDEX(-1)];
+		int b = foil->dctfreq[DCTINDEX(-2)];
 
 		if (a < b) {
 			fprintf(stderr, "Can not calculate estimate\n");
 			res = -1;
 		} else
-			res = 2*bitmap->bits*b/(a + b);
+			res = 2 * (u_int64_t)bitmap->bits * b / (a + b);
 
 		/* Pending threshold based on frequencies */
 		for (int i = 0; i < DCTENTRIES; i++) {
-			dctfreq[i] = dctfreq[i] /
+			foil->dctfreq[i] = foil->dctfreq[i] /
 				((float)bitmap->bits / DCTFREQRANGE);
-			dctfreq[i] /= DCTFREQREDUCE;
-			if (dctfreq[i] < DCTFREQMIN)
-				dctfreq[i] = DCTFREQMIN;
+			foil->dctfreq[i] /= DCTFREQREDUCE;
+			if (foil->dctfreq[i] < DCTFREQMIN)
+				foil->dctfreq[i] = DCTFREQMIN;
 
-			if (jpeg_eval)
+			if (foil->eval)
 				fprintf(stderr, "Foil: %d :< %d\n",
-					i - 127, dctfreq[i]);
+					i - 128, foil->dctfreq[i]);
 		}
 
 		bitmap->maxcorrect = res;
@@ -202,10 +298,10 @@ preserve_jpg(bitmap *bitmap, int off)
 	} else if (off >= bitmap->bits) {
 		/* Reached end of image */
 		for (int i = 0; i < DCTENTRIES; i++) {
-			while (dctadjust[i]) {
-				dctadjust[i]--;
+			while (foil->dctadjust[i]) {
+				foil->dctadjust[i]--;
 
-				coeff = i - 127;
+				coeff = i - 128;
 
 				if (preserve_single(bitmap, bitmap->bits - 1,
 						    coeff) != -1)
@@ -215,22 +311,26 @@ preserve_jpg(bitmap *bitmap, int off)
 			}
 		}
 
+		free(foil);
+		bitmap->priv = NULL;
+
 		return(0);
 	}
 
 	/* We need to find this coefficient, and change it to data[off] */
 	coeff = data[off] ^ 0x01;
 
-	if (dctadjust[data[off] + 127]) {
+	if (foil->dctadjust[DCTINDEX(data[off])]) {
 		/* But we are still missing compensation for the opposite */
-		dctadjust[data[off] + 127]--;
-		dctpending--;
+		foil->dctadjust[DCTINDEX(data[off])]--;
+		foil->dctpending--;
 		return (0);
 	}
 
-	if (dctadjust[coeff + 127] < dctfreq[coeff + 127]) {
-		dctadjust[coeff + 127]++;
-		dctpending++;
+	if (foil->dctadjust[DCTINDEX(coeff)] <
+	    foil->dctfreq[DCTINDEX(coeff)]) {
+		foil->dctadjust[DCTINDEX(coeff)]++;
+		foil->dctpending++;
 		return (0);
 	}
 
@@ -242,119 +342,394 @@ preserve_jpg(bitmap *bitmap, int off)
 	}
 
 	/* We have one too many of this */
-	dctadjust[coeff + 127]++;
-	dctpending++;
+	foil->dctadjust[DCTINDEX(coeff)]++;
+	foil->dctpending++;
 
 	return (-1);
 }
 
-bitmap *
-finish_state(void)
+static bitmap *
+finish_state(jpgsteg *js)
 {
 	int i;
 	bitmap *pbitmap;
+	bitmap *tbitmap = &js->tbitmap;
 
-	if (jpeg_eval)
+	if (js->eval)
 		fprintf(stderr, "\n");
 
-	if (jpeg_state != JPEG_READING)
+	if (js->state != JPEG_READING)
 		return NULL;
 
-	tbitmap.bits = off;
-	tbitmap.bytes = (off + 7) / 8;
+	tbitmap->bits = js->off;
+	tbitmap->bytes = (js->off + 7) / 8;
+
+	tbitmap->bitmap = trim_state(tbitmap->bitmap, tbitmap->bytes);
+	tbitmap->locked = trim_state(tbitmap->locked, tbitmap->bytes);
+	tbitmap->data = spill_trim(tbitmap->data, tbitmap->bits);
 
-	tbitmap.detect = checkedmalloc(tbitmap.bits);
-	tbitmap.metalock = checkedmalloc(tbitmap.bytes);
+	tbitmap->detect = spill_alloc(tbitmap->bits);
+	tbitmap->metalock = checkedmalloc(tbitmap->bytes);
 
-	for (i = 0; i < off; i++) {
-		char temp = abs(tbitmap.data[i]);
+	for (i = 0; i < js->off; i++) {
+		char temp = abs(tbitmap->data[i]);
 		if (temp >= JPG_THRES_MAX)
-			tbitmap.detect[i] = -1;
+			tbitmap->detect[i] = -1;
 		else if (temp >= JPG_THRES_LOW)
-			tbitmap.detect[i] = 0;
+			tbitmap->detect[i] = 0;
 		else if (temp >= JPG_THRES_MIN)
-			tbitmap.detect[i] = 1;
+			tbitmap->detect[i] = 1;
 		else
-			tbitmap.detect[i] = 2;
+			tbitmap->detect[i] = 2;
 	}
 
 	pbitmap = checkedmalloc(sizeof(bitmap));
 
-	memcpy(pbitmap, &tbitmap, sizeof(tbitmap));
+	memcpy(pbitmap, tbitmap, sizeof(*tbitmap));
 
 	return pbitmap;
 }
 
-short
-steg_use_bit (unsigned short temp)
+/*
+ * Handles a single coefficient and prints it, only used to evaluate.
+ */
+
+static short
+steg_use_bit (jpgsteg *js, unsigned short temp)
 {
+	bitmap *tbitmap = &js->tbitmap;
+
   	if ((temp & 0x1) == temp)
 		goto steg_end;
 
-	switch (jpeg_state) {
+	switch (js->state) {
 	case JPEG_READING:
-		WRITE_BIT(tbitmap.bitmap, off, temp & 0x1);
-		tbitmap.data[off] = temp;
+		WRITE_BIT(tbitmap->bitmap, js->off, temp & 0x1);
+		tbitmap->data[js->off] = temp;
+		js->off++;
+		break;
+	default:
+		temp = (temp & ~0x1) |
+			(TEST_BIT(tbitmap->bitmap, js->off) ? 1 : 0);
+		js->off++;
+
+		break;
+	}
 
-		if ((short)temp < dctmin)
-			dctmin = (short)temp;
-		if ((short)temp > dctmax)
-			dctmax = (short)temp;
+ steg_end:
+	if (js->eval_cnt % DCTSIZE2 == 0)
+		fprintf(stderr, "\n[%d]%.7d: ", js->state, js->eval_cnt);
+	if ((temp & 0x1) != temp)
+		fprintf(stderr, "% .3d,", (short) temp);
+	js->eval_cnt++;
 
-		off++;
+	return temp;
+}
 
-		if (off >= tbitmap.bits) {
-			u_char *buf;
+/*
+ * Returns a mask with a bit set for every coefficient of a block that
+ * can carry data, i.e. that is neither 0 nor 1.
+ */
 
-			tbitmap.bytes += 256;
-			tbitmap.bits += 256 * 8;
-			if (!(buf = realloc(tbitmap.bitmap, tbitmap.bytes))) {
-				fprintf(stderr, "steg_use_bit: realloc()\n");
-				exit(1);
-			}
-			tbitmap.bitmap = buf;
-			if (!(buf = realloc(tbitmap.locked, tbitmap.bytes))) {
-				fprintf(stderr, "steg_use_bit: realloc()\n");
-				exit(1);
-			}
-			tbitmap.locked = buf;
-			memset(tbitmap.locked + tbitmap.bytes - 256, 0, 256);
-			if (!(buf = realloc(tbitmap.data, tbitmap.bits))) {
-				fprintf(stderr, "steg_use_bit: realloc()\n");
-				exit(1);
-			}
-			tbitmap.data = buf;
+static u_int64_t
+usable_coeffs(JCOEFPTR block)
+{
+	u_int64_t mask = 0;
+	int k;
+#ifdef __SSE2__
+	const __m128i lsb = _mm_set1_epi16(~0x1);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo, hi;
+
+	/* 16 coefficients at a time, one mask bit for each */
+	for (k = 0; k < DCTSIZE2; k += 16) {
+		lo = _mm_loadu_si128((__m128i *)(block + k));
+		hi = _mm_loadu_si128((__m128i *)(block + k + 8));
+		lo = _mm_cmpeq_epi16(_mm_and_si128(lo, lsb), zero);
+		hi = _mm_cmpeq_epi16(_mm_and_si128(hi, lsb), zero);
+		mask |= (u_int64_t)(u_int16_t)
+			_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << k;
+	}
+
+	return ~mask;
+#else
+	for (k = 0; k < DCTSIZE2; k++)
+		if (block[k] & ~0x1)
+			mask |= (u_int64_t)1 << k;
+
+	return mask;
+#endif /* __SSE2__ */
+}
+
+#ifdef __GNUC__
+#define LOWEST_BIT(x)	__builtin_ctzll(x)
+#else
+static int
+LOWEST_BIT(u_int64_t x)
+{
+	int n;
+
+	for (n = 0; !(x & 1); n++)
+		x >>= 1;
+
+	return n;
+}
+#endif /* __GNUC__ */
+
+/*
+ * Let the JPEG library spread independent work over our threads.
+ */
+
+int
+steg_threads(void)
+{
+	return (jobs_threads());
+}
+
+void
+steg_run_jobs(int njobs, void (*job)(void *, int), void *arg)
+{
+	jobs_run(njobs, job, arg);
+}
+
+/*
+ * Called by the JPEG library for every block of quantized coefficients
+ * with the client_data of the compression or decompression object.
+ * Without a pass to report to, or while the compressor only captures
+ * blocks for a later walk_coeffs, the block is left alone.
+ */
+
+void
+steg_use_block (void *ctx, JCOEFPTR block)
+{
+	jpgsteg *js = ctx;
+	bitmap *tbitmap;
+	u_int64_t mask;
+	int k;
+
+	if (js == NULL || js->state == JPEG_CAPTURING)
+		return;
+
+	tbitmap = &js->tbitmap;
+
+	if (js->state == JPEG_READING && js->off + DCTSIZE2 > tbitmap->bits) {
+		fprintf(stderr, "steg_use_block: too many blocks\n");
+		exit(1);
+	}
+
+	if (js->eval) {
+		for (k = 0; k < DCTSIZE2; k++)
+			block[k] = steg_use_bit(js, block[k]);
+		return;
+	}
+
+	/* Only visit the coefficients that carry data, most are zero */
+	mask = usable_coeffs(block);
+
+	if (js->state == JPEG_READING) {
+		for (; mask; mask &= mask - 1) {
+			k = LOWEST_BIT(mask);
+			WRITE_BIT(tbitmap->bitmap, js->off, block[k] & 0x1);
+			tbitmap->data[js->off] = block[k];
+			js->off++;
 		}
-		break;
-	default:
-		temp = (temp & ~0x1) | (TEST_BIT(tbitmap.bitmap, off) ? 1 : 0);
-		off++;
+	} else {
+		for (; mask; mask &= mask - 1) {
+			k = LOWEST_BIT(mask);
+			block[k] = (block[k] & ~0x1) |
+				(TEST_BIT(tbitmap->bitmap, js->off) ? 1 : 0);
+			js->off++;
+		}
+	}
+}
 
-		break;
+/*
+ * Runs every DCT block of a coefficient image through steg_use_block in the
+ * order a single sequential scan codes them, skipping the dummy blocks at
+ * the right and bottom edges.  This is the order in which the compressor
+ * and decompressor hooks see the blocks, so the bitmap does not depend on
+ * whether it was obtained from pixels or from coefficients.
+ */
+
+static void
+walk_coeffs(jpgcoeffs *jc, jpgsteg *js, boolean writable)
+{
+	j_common_ptr cinfo = jc->owner;
+	jpeg_component_info *compptr = jc->comp_info;
+	int ncomps = jc->num_components;
+	JBLOCKARRAY buffer[MAX_COMPONENTS];
+	JDIMENSION mrow, mcol, row, col;
+	int ci, yi, xi;
+
+	if (ncomps == 1) {
+		/* Non-interleaved scans code the blocks in raster order */
+		for (row = 0; row < compptr->height_in_blocks; row++) {
+			buffer[0] = (*cinfo->mem->access_virt_barray)
+				(cinfo, jc->arrays[0], row, 1, writable);
+			for (col = 0; col < compptr->width_in_blocks; col++)
+				steg_use_block(js, buffer[0][0][col]);
+		}
+		return;
 	}
 
- steg_end:
-	if (jpeg_eval) {
-		if (eval_cnt % DCTSIZE2 == 0)
-			fprintf(stderr, "\n[%d]%.7d: ", jpeg_state, eval_cnt);
-		if ((temp & 0x1) != temp)
-			fprintf(stderr, "% .3d,", (short) temp);
-		eval_cnt++;
+	for (mrow = 0; mrow < jc->mcu_rows; mrow++) {
+		for (ci = 0; ci < ncomps; ci++)
+			buffer[ci] = (*cinfo->mem->access_virt_barray)
+				(cinfo, jc->arrays[ci],
+				 mrow * compptr[ci].v_samp_factor,
+				 (JDIMENSION) compptr[ci].v_samp_factor,
+				 writable);
+
+		for (mcol = 0; mcol < jc->mcus_per_row; mcol++) {
+			for (ci = 0; ci < ncomps; ci++) {
+				int h = compptr[ci].h_samp_factor;
+				int v = compptr[ci].v_samp_factor;
+
+				for (yi = 0; yi < v; yi++) {
+					row = mrow * v + yi;
+					if (row >= compptr[ci].height_in_blocks)
+						break;
+					for (xi = 0; xi < h; xi++) {
+						col = mcol * h + xi;
+						if (col >= compptr[ci].width_in_blocks)
+							break;
+						steg_use_block(js,
+						    buffer[ci][yi][col]);
+					}
+				}
+			}
+		}
 	}
+}
 
-	return temp;
+static void
+coeffs_geometry(jpgcoeffs *jc, JDIMENSION width, JDIMENSION height,
+		int max_h, int max_v)
+{
+	jc->mcus_per_row = (width + max_h * DCTSIZE - 1) / (max_h * DCTSIZE);
+	jc->mcu_rows = (height + max_v * DCTSIZE - 1) / (max_v * DCTSIZE);
+}
+
+/*
+ * Under a memory limit, the coefficient arrays that do not fit are moved
+ * to backing store by the JPEG library.  It gets half of the limit.
+ */
+
+static void
+limit_memory(j_common_ptr cinfo)
+{
+	if (spill_limit())
+		cinfo->mem->max_memory_to_use = (long)(spill_limit() / 2);
 }
 
 void
+free_JPEG_coeffs(image *image)
+{
+	jpgcoeffs *jc = image->priv;
+
+	jpeg_destroy(jc->owner);
+	free(jc);
+
+	image->priv = NULL;
+}
+
+/*
+ * Reads the quantized coefficients of a JPEG without decoding it to
+ * pixels and extracts the bitmap from them.  The JPEG comes from infile,
+ * or if that is NULL, from the len bytes at data.
+ */
+
+image *
+read_JPEG_coeffs(FILE *infile, const u_char *data, size_t len)
+{
+	image *image;
+	jpgcoeffs *jc;
+	jpgsteg steg;
+	struct jpeg_decompress_struct *dinfo;
+
+	init_state(&steg, JPEG_READING, 0, NULL);
+
+	image = checkedmalloc(sizeof(*image));
+	memset(image, 0, sizeof(*image));
+
+	jc = checkedmalloc(sizeof(*jc));
+	memset(jc, 0, sizeof(*jc));
+	dinfo = &jc->dinfo;
+
+	dinfo->err = jpeg_std_error(&jc->jerr);
+	jpeg_create_decompress(dinfo);
+	limit_memory((j_common_ptr) dinfo);
+	if (infile != NULL)
+		jpeg_stdio_src(dinfo, infile);
+	else
+		jpeg_mem_src(dinfo, data, len);
+
+	(void) jpeg_read_header(dinfo, TRUE);
+
+	/* Reads all scans, but neither dequantizes nor transforms them */
+	jc->arrays = jpeg_read_coefficients(dinfo);
+
+	size_state(&steg, dinfo->comp_info, dinfo->num_components);
+
+	jc->owner = (j_common_ptr) dinfo;
+	jc->comp_info = dinfo->comp_info;
+	jc->num_components = dinfo->num_components;
+	coeffs_geometry(jc, dinfo->image_width, dinfo->image_height,
+			dinfo->max_h_samp_factor, dinfo->max_v_samp_factor);
+
+	image->x = dinfo->image_width;
+	image->y = dinfo->image_height;
+	image->depth = dinfo->num_components;
+	image->max = 255;
+	image->priv = jc;
+
+	walk_coeffs(jc, &steg, FALSE);
+
+	image->bitmap = finish_state(&steg);
+
+	return image;
+}
+
+/*
+ * The parameter is a comma separated list: a number sets the compression
+ * quality, "opt" asks for Huffman tables optimized for the output image,
+ * "rst" for restart markers, which let the rows be encoded in parallel.
+ * Returns 1 if the image has to be compressed again from pixels.
+ */
+
+int
 init_JPEG_handler(char *parameter)
 {
-	if (parameter)
-		quality = atoi(parameter);
-	if (quality < 75)
-		quality = 75;
-	if (quality > 100)
-		quality = 100;
-	fprintf(stderr, "JPEG compression quality set to %d\n", quality);
+	char *copy, *p;
+	int recompress = 0;
+
+	if (parameter == NULL)
+		return (0);
+
+	copy = checkedmalloc(strlen(parameter) + 1);
+	strcpy(copy, parameter);
+	for (p = strtok(copy, ","); p != NULL; p = strtok(NULL, ",")) {
+		if (!strcmp(p, "opt")) {
+			optimize = 1;
+			continue;
+		}
+		if (!strcmp(p, "rst")) {
+			restart = 1;
+			continue;
+		}
+		quality = atoi(p);
+		if (quality < 75)
+			quality = 75;
+		if (quality > 100)
+			quality = 100;
+		recompress = 1;
+	}
+	free(copy);
+
+	if (optimize)
+		fprintf(stderr, "JPEG Huffman tables will be optimized\n");
+
+	return (recompress);
 }
 
 void
@@ -362,7 +737,8 @@ bitmap_from_jpg(bitmap *dbitmap, image *image, int flags)
 {
 	bitmap *tmpmap;
 
-	if (flags & STEG_RETRIEVE) {
+	/* Coefficients read from a JPEG already determine the bitmap */
+	if ((flags & STEG_RETRIEVE) || image->priv != NULL) {
 		memcpy(dbitmap, image->bitmap, sizeof(*dbitmap));
 		free (image->bitmap);
 		image->bitmap = NULL;
@@ -373,6 +749,8 @@ bitmap_from_jpg(bitmap *dbitmap, image *image, int flags)
 		tmpmap = image->bitmap;
 		free (tmpmap->bitmap);
 		free (tmpmap->locked);
+		spill_free (tmpmap->detect);
+		spill_free (tmpmap->data);
 		free (tmpmap);
 		image->bitmap = NULL;
 	}
@@ -385,7 +763,48 @@ bitmap_from_jpg(bitmap *dbitmap, image *image, int flags)
 void
 bitmap_to_jpg(image *image, bitmap *bitmap, int flags)
 {
-	init_state(JPEG_WRITING, steg_stat >= 3 ? 1 : 0, bitmap);
+	jpgsteg steg;
+
+	init_state(&steg, JPEG_WRITING, steg_stat >= 3 ? 1 : 0, bitmap);
+
+	walk_coeffs(image->priv, &steg, TRUE);
+
+	finish_state(&steg);
+}
+
+/*
+ * The pixels changed after the bitmap went into the coefficients, e.g.
+ * by the Fourier transform.  They are compressed again and the bitmap
+ * goes into the new coefficients, as when compressing from pixels.
+ */
+
+void
+recompress_JPEG(image *image, bitmap *sbitmap, int flags)
+{
+	bitmap *tmpmap;
+	int i, n;
+
+	if (image->priv != NULL)
+		free_JPEG_coeffs(image);
+
+	/*
+	 * The number of usable coefficients may have changed.  Bits past
+	 * the end of the old bitmap keep the value they have now.
+	 */
+	tmpmap = compress_JPEG(image);
+	n = sbitmap->bits < tmpmap->bits ? sbitmap->bits : tmpmap->bits;
+	memcpy(tmpmap->bitmap, sbitmap->bitmap, n / 8);
+	for (i = n & ~7; i < n; i++)
+		WRITE_BIT(tmpmap->bitmap, i,
+		    TEST_BIT(sbitmap->bitmap, i) ? 1 : 0);
+
+	bitmap_to_jpg(image, tmpmap, flags);
+
+	free (tmpmap->bitmap);
+	free (tmpmap->locked);
+	spill_free (tmpmap->detect);
+	spill_free (tmpmap->data);
+	free (tmpmap);
 }
 
 /******************** JPEG COMPRESSION SAMPLE INTERFACE *******************/
@@ -417,151 +836,334 @@ extern int image_height;	/* Number of rows in image */
 extern int image_width;		/* Number of columns in image */
 
 
+/*
+ * Compression parameters for pixel data.  They have to be identical for
+ * the pass that computes the coefficients and the one that writes them.
+ */
+
+void
+set_JPEG_params (j_compress_ptr cinfo, image *image)
+{
+  cinfo->image_width = image->x; 	/* image width and height, in pixels */
+  cinfo->image_height = image->y;
+  cinfo->input_components = image->depth;/* # of color components per pixel */
+  /* colorspace of input image */
+  cinfo->in_color_space = image->depth == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+  jpeg_set_defaults(cinfo);
+
+  jpeg_set_quality(cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+}
+
+/*
+ * Takes the place of the Huffman encoder while pixels are compressed.
+ * The quantized blocks of each MCU are stored in the whole-image arrays,
+ * so that they only need to be entropy coded once, after embedding.
+ * A compressor for a band of the image stores its blocks mcu_row0 MCU
+ * rows down, into rows that were accessed beforehand.
+ */
+
+METHODDEF(boolean)
+capture_mcu (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
+{
+  jpgcoeffs *jc = ((jpgsteg *) cinfo->client_data)->coeffs;
+  JDIMENSION mrow = jc->mcu_ctr / cinfo->MCUs_per_row;
+  JDIMENSION mcol = jc->mcu_ctr % cinfo->MCUs_per_row;
+  JDIMENSION row, col;
+  jpeg_component_info *compptr;
+  JBLOCKROW blockrow;
+  int blkn, ci, c, v, yi, xi;
+
+  blkn = 0;
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+    compptr = cinfo->cur_comp_info[ci];
+    c = compptr->component_index;
+    v = compptr->v_samp_factor;
+    for (yi = 0; yi < compptr->MCU_height; yi++) {
+      row = mrow * compptr->MCU_height + yi;
+      if (jc->image_rows[c] != NULL)
+	blockrow = jc->image_rows[c][jc->mcu_row0 * compptr->MCU_height + row];
+      else {
+	/* Arrays are accessed sequentially, one iMCU row at a time */
+	if (mcol == 0 && row % v == 0)
+	  jc->rows[c] = (*cinfo->mem->access_virt_barray)
+	    ((j_common_ptr) cinfo, jc->arrays[c], row, (JDIMENSION) v, TRUE);
+	blockrow = jc->rows[c][row % v];
+      }
+      for (xi = 0; xi < compptr->MCU_width; xi++, blkn++) {
+	col = mcol * compptr->MCU_width + xi;
+	/* Dummy blocks at the edges are not kept */
+	if (row < compptr->height_in_blocks && col < compptr->width_in_blocks)
+	  memcpy(blockrow[col], MCU_data[blkn], sizeof(JBLOCK));
+      }
+    }
+  }
+
+  jc->mcu_ctr++;
+
+  return TRUE;
+}
+
+/*
+ * Colour conversion, downsampling and DCT of one iMCU row only depend on
+ * the pixels of that row.  With threads, the image is cut into bands of
+ * whole iMCU rows and every band is compressed by a compressor of its
+ * own, with the same parameters.  The blocks come out exactly as if the
+ * image were compressed in one piece.
+ */
+
+typedef struct {
+  jpgcoeffs *jc;		/* rows of the whole image */
+  image *image;
+  JDIMENSION band_rows;		/* iMCU rows per band */
+  int imcu_height;		/* pixel rows per iMCU row */
+} jpgbands;
+
+static void
+compress_band (void *arg, int i)
+{
+  jpgbands *bands = arg;
+  image *image = bands->image;
+  jpgcoeffs *bjc;
+  jpgsteg steg;
+  j_compress_ptr cinfo;
+  JSAMPROW row_pointer[1];
+  JDIMENSION first, rows, imcu_row;
+  int row_stride = image->x * image->depth;
+
+  imcu_row = (JDIMENSION) i * bands->band_rows;
+  first = imcu_row * bands->imcu_height;
+  rows = bands->band_rows * bands->imcu_height;
+  if (rows > image->y - first)
+    rows = image->y - first;
+
+  /* The blocks go straight to their rows, the bitmap is taken later */
+  init_state(&steg, JPEG_CAPTURING, 0, NULL);
+  bjc = checkedmalloc(sizeof(*bjc));
+  memset(bjc, 0, sizeof(*bjc));
+  memcpy(bjc->image_rows, bands->jc->image_rows, sizeof(bjc->image_rows));
+  steg.coeffs = bjc;
+  cinfo = &bjc->cinfo;
+
+  cinfo->err = jpeg_std_error(&bjc->jerr);
+  jpeg_create_compress(cinfo);
+  cinfo->client_data = &steg;
+
+  jpeg_dummy_dest(cinfo);
+
+  set_JPEG_params(cinfo, image);
+  cinfo->image_height = rows;
+
+  jpeg_start_compress(cinfo, TRUE);
+  cinfo->entropy->encode_mcu = capture_mcu;
+
+  /* MCU rows of a single component scan are block rows */
+  bjc->mcu_row0 = imcu_row;
+  if (cinfo->comps_in_scan == 1)
+    bjc->mcu_row0 *= cinfo->cur_comp_info[0]->v_samp_factor;
+
+  while (cinfo->next_scanline < cinfo->image_height) {
+    row_pointer[0] = & image->img[(first + cinfo->next_scanline) * row_stride];
+    (void) jpeg_write_scanlines(cinfo, row_pointer, 1);
+  }
+
+  jpeg_destroy_compress(cinfo);
+  free(bjc);
+}
+
+/*
+ * Runs colour conversion, downsampling, DCT and quantization over the
+ * pixels once.  The bitmap is taken from the quantized coefficients and
+ * those are kept with the image for write_JPEG_file.
+ */
+
 bitmap *
 compress_JPEG (image *image)
 {
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
+  jpgcoeffs *jc;
+  jpgsteg steg;
+  j_compress_ptr cinfo;
+  jpeg_component_info *compptr;
   /* More stuff */
   JSAMPROW row_pointer[1];	/* pointer to JSAMPLE row[s] */
   int row_stride;		/* physical row width in image buffer */
+  JDIMENSION rows;
+  jpgbands bands;
+  int ci, nbands;
 
-  init_state(JPEG_READING, steg_stat >= 3 ? 1 : 0, NULL);
-
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
+  init_state(&steg, JPEG_READING, steg_stat >= 3 ? 1 : 0, NULL);
 
-  jpeg_dummy_dest(&cinfo);
+  jc = checkedmalloc(sizeof(*jc));
+  memset(jc, 0, sizeof(*jc));
+  cinfo = &jc->cinfo;
 
-  cinfo.image_width = image->x; 	/* image width and height, in pixels */
-  cinfo.image_height = image->y;
-  cinfo.input_components = image->depth;/* # of color components per pixel */
-  cinfo.in_color_space = JCS_RGB; 	/* colorspace of input image */
+  cinfo->err = jpeg_std_error(&jc->jerr);
+  jpeg_create_compress(cinfo);
+  limit_memory((j_common_ptr) cinfo);
+  /* The DCT reports to steg, capture_mcu stores into jc */
+  steg.coeffs = jc;
+  cinfo->client_data = &steg;
 
-  jpeg_set_defaults(&cinfo);
+  jpeg_dummy_dest(cinfo);
 
-  jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+  set_JPEG_params(cinfo, image);
+  fprintf(stderr, "JPEG compression quality set to %d\n", quality);
 
-  jpeg_start_compress(&cinfo, TRUE);
+  jpeg_start_compress(cinfo, TRUE);
 
-  row_stride = image->x * 3;	/* JSAMPLEs per row in image_buffer */
+  /* Bands are only worth it with threads to run them on, and they need
+   * all coefficients in memory.
+   */
+  nbands = jobs_threads() > 1 && !spill_limit() ? jobs_threads() * 4 : 1;
+  if ((JDIMENSION) nbands > cinfo->total_iMCU_rows)
+    nbands = (int) cinfo->total_iMCU_rows;
 
-  while (cinfo.next_scanline < cinfo.image_height) {
-    row_pointer[0] = & image->img[cinfo.next_scanline * row_stride];
-    (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+  /* Block counts are known now; the arrays live until we are destroyed.
+   * Bands need all rows at once, one iMCU row is enough otherwise.
+   */
+  jc->arrays = (jvirt_barray_ptr *) (*cinfo->mem->alloc_small)
+    ((j_common_ptr) cinfo, JPOOL_IMAGE,
+     sizeof(jvirt_barray_ptr) * cinfo->num_components);
+  for (ci = 0, compptr = cinfo->comp_info; ci < cinfo->num_components;
+       ci++, compptr++) {
+    rows = (JDIMENSION) jround_up((long) compptr->height_in_blocks,
+				  (long) compptr->v_samp_factor);
+    jc->arrays[ci] = (*cinfo->mem->request_virt_barray)
+      ((j_common_ptr) cinfo, JPOOL_IMAGE, FALSE,
+       (JDIMENSION) jround_up((long) compptr->width_in_blocks,
+			      (long) compptr->h_samp_factor),
+       rows, nbands > 1 ? rows : (JDIMENSION) compptr->v_samp_factor);
+  }
+  (*cinfo->mem->realize_virt_arrays) ((j_common_ptr) cinfo);
+
+  size_state(&steg, cinfo->comp_info, cinfo->num_components);
+
+  cinfo->entropy->encode_mcu = capture_mcu;
+
+  jc->owner = (j_common_ptr) cinfo;
+  jc->comp_info = cinfo->comp_info;
+  jc->num_components = cinfo->num_components;
+  coeffs_geometry(jc, cinfo->image_width, cinfo->image_height,
+		  cinfo->max_h_samp_factor, cinfo->max_v_samp_factor);
+
+  if (nbands > 1) {
+    for (ci = 0, compptr = cinfo->comp_info; ci < cinfo->num_components;
+	 ci++, compptr++)
+      jc->image_rows[ci] = (*cinfo->mem->access_virt_barray)
+	((j_common_ptr) cinfo, jc->arrays[ci], (JDIMENSION) 0,
+	 (JDIMENSION) jround_up((long) compptr->height_in_blocks,
+				(long) compptr->v_samp_factor), TRUE);
+
+    bands.jc = jc;
+    bands.image = image;
+    bands.band_rows = (cinfo->total_iMCU_rows + nbands - 1) / nbands;
+    bands.imcu_height = cinfo->max_v_samp_factor * DCTSIZE;
+    nbands = (int) ((cinfo->total_iMCU_rows + bands.band_rows - 1) /
+		    bands.band_rows);
+    jobs_run(nbands, compress_band, &bands);
+
+    /* The hooks saw nothing, the blocks are visited in scan order now */
+    memset(jc->image_rows, 0, sizeof(jc->image_rows));
+    walk_coeffs(jc, &steg, FALSE);
+  } else {
+    row_stride = image->x * image->depth; /* JSAMPLEs per row in image_buffer */
+
+    while (cinfo->next_scanline < cinfo->image_height) {
+      row_pointer[0] = & image->img[cinfo->next_scanline * row_stride];
+      (void) jpeg_write_scanlines(cinfo, row_pointer, 1);
+    }
   }
 
-  jpeg_finish_compress(&cinfo);
-  jpeg_destroy_compress(&cinfo);
+  /* The compressor is not finished, that would release the arrays */
+  cinfo->client_data = NULL;
+  image->priv = jc;
 
-  return finish_state();
+  return finish_state(&steg);
 }
 
 /*
- * Sample routine for JPEG compression.  We assume that the target file name
- * and a compression quality factor are passed in.
+ * Sample routine for JPEG compression.  The quantized coefficients have
+ * been computed already, either by read_JPEG_coeffs or by compress_JPEG,
+ * and carry the embedded data.  All that is left is entropy coding.
+ * The JPEG goes to outfile, or if that is NULL, to a buffer allocated
+ * with malloc, which is returned in *data and *len.
  */
 
-void
-write_JPEG_file (FILE *outfile, image *image)
+static void
+write_JPEG (FILE *outfile, u_char **data, size_t *len, image *image)
 {
+  jpgcoeffs *jc = image->priv;
   /* This struct contains the JPEG compression parameters and pointers to
    * working space (which is allocated as needed by the JPEG library).
-   * It is possible to have several such structures, representing multiple
-   * compression/decompression processes, in existence at once.  We refer
-   * to any one struct (and its associated working data) as a "JPEG object".
    */
   struct jpeg_compress_struct cinfo;
-  /* This struct represents a JPEG error handler.  It is declared separately
-   * because applications often want to supply a specialized error handler
-   * (see the second half of this file for an example).  But here we just
-   * take the easy way out and use the standard error handler, which will
-   * print a message on stderr and call exit() if compression fails.
-   * Note that this struct must live as long as the main JPEG parameter
-   * struct, to avoid dangling-pointer problems.
+  /* This struct represents a JPEG error handler.  We just take the easy
+   * way out and use the standard error handler, which will print a
+   * message on stderr and call exit() if compression fails.
    */
   struct jpeg_error_mgr jerr;
-  /* More stuff */
-  JSAMPROW row_pointer[1];	/* pointer to JSAMPLE row[s] */
-  int row_stride;		/* physical row width in image buffer */
 
   /* Step 1: allocate and initialize JPEG compression object */
 
-  /* We have to set up the error handler first, in case the initialization
-   * step fails.  (Unlikely, but it could happen if you are out of memory.)
-   * This routine fills in the contents of struct jerr, and returns jerr's
-   * address which we place into the link field in cinfo.
-   */
   cinfo.err = jpeg_std_error(&jerr);
-  /* Now we can initialize the JPEG compression object. */
   jpeg_create_compress(&cinfo);
+  limit_memory((j_common_ptr) &cinfo);
 
   /* Step 2: specify data destination (eg, a file) */
-  /* Note: steps 2 and 3 can be done in either order. */
 
-  /* Here we use the library-supplied code to send compressed data to a
-   * stdio stream.  You can also write your own code to do something else.
-   */
-  jpeg_stdio_dest(&cinfo, outfile);
+  if (outfile != NULL)
+    jpeg_stdio_dest(&cinfo, outfile);
+  else
+    jpeg_mem_dest(&cinfo, data, len);
 
   /* Step 3: set parameters for compression */
 
-  /* First we supply a description of the input image.
-   * Four fields of the cinfo struct must be filled in:
-   */
-  cinfo.image_width = image->x; 	/* image width and height, in pixels */
-  cinfo.image_height = image->y;
-  cinfo.input_components = image->depth;/* # of color components per pixel */
-  cinfo.in_color_space = JCS_RGB; 	/* colorspace of input image */
-  /* Now use the library's routine to set default compression parameters.
-   * (You must set at least cinfo.in_color_space before calling this,
-   * since the defaults depend on the source color space.)
+  /* A JPEG cover keeps its own quantization tables and sampling,
+   * and a progressive cover is written progressive again.
    */
-  jpeg_set_defaults(&cinfo);
-  /* Now you can set any non-default parameters you wish to.
-   * Here we just illustrate the use of quality (quantization table) scaling:
+  if (jc->owner == (j_common_ptr) &jc->dinfo) {
+    jpeg_copy_critical_parameters(&jc->dinfo, &cinfo);
+    if (jc->dinfo.progressive_mode)
+      jpeg_simple_progression(&cinfo);
+  } else
+    set_JPEG_params(&cinfo, image);
+
+  /* The coefficients are all at hand, so optimizing the Huffman tables
+   * only costs an extra pass over the blocks, not over the pixels.
    */
-  jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+  cinfo.optimize_coding = optimize;
 
-  /* Step 4: Start compressor */
+  /* Restart intervals are entropy coded in parallel when we have threads */
+  if (restart)
+    cinfo.restart_in_rows = 1;
 
-  /* TRUE ensures that we will write a complete interchange-JPEG file.
-   * Pass TRUE unless you are very sure of what you're doing.
-   */
-  jpeg_start_compress(&cinfo, TRUE);
+  /* Step 4: Start compressor with the coefficient arrays as input */
 
-  /* Step 5: while (scan lines remain to be written) */
-  /*           jpeg_write_scanlines(...); */
+  jpeg_write_coefficients(&cinfo, jc->arrays);
 
-  /* Here we use the library's state variable cinfo.next_scanline as the
-   * loop counter, so that we don't have to keep track ourselves.
-   * To keep things simple, we pass one scanline per call; you can pass
-   * more if you wish, though.
-   */
-  row_stride = image->x * 3;	/* JSAMPLEs per row in image_buffer */
-
-  while (cinfo.next_scanline < cinfo.image_height) {
-    /* jpeg_write_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could pass
-     * more than one scanline at a time if that's more convenient.
-     */
-    row_pointer[0] = & image->img[cinfo.next_scanline * row_stride];
-    (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
-  }
-
-  /* Step 6: Finish compression */
+  /* Step 5: Finish compression, this does the entropy coding */
 
   jpeg_finish_compress(&cinfo);
   /* After finish_compress, we can close the output file. */
-  fclose(outfile);
+  if (outfile != NULL)
+    fclose(outfile);
 
-  /* Step 7: release JPEG compression object */
+  /* Step 6: release JPEG compression objects */
 
-  /* This is an important step since it will release a good deal of memory. */
   jpeg_destroy_compress(&cinfo);
+  free_JPEG_coeffs(image);
+}
 
-  /* And we're done! */
-  finish_state();
+void
+write_JPEG_file (FILE *outfile, image *image)
+{
+  write_JPEG(outfile, NULL, NULL, image);
+}
+
+void
+write_JPEG_mem (image *image, u_char **data, size_t *len)
+{
+  write_JPEG(NULL, data, len, image);
 }
 
 
@@ -612,14 +1214,286 @@ write_JPEG_file (FILE *outfile, image *image)
  */
 
 
+/*
+ * With threads, pixels are made in two stages.  The coefficients of the
+ * whole image are read first, which spreads the Huffman decoding over the
+ * threads when the JPEG has restart markers.  Then the image is cut into
+ * bands of whole iMCU rows, and a decompressor for each band runs the
+ * IDCT, upsampling and colour conversion on the blocks of its rows.
+ *
+ * A band decompressor reads the tables and frame of the JPEG, with the
+ * height changed to that of the band, and takes its blocks from the
+ * whole-image arrays instead of from the scan.  Fancy upsampling looks one
+ * iMCU row up and down, so a band starts and ends one iMCU row beyond the
+ * rows it keeps, unless it is at the edge of the image.  The pixels are
+ * then exactly those of a single decompressor.
+ */
+
+typedef struct {
+  jpgcoeffs *jc;		/* coefficients of the whole image */
+  image *image;
+  const u_char *header;		/* JPEG up to the scan data */
+  size_t header_len;
+  size_t height_off;		/* offset of the height in the frame */
+  JDIMENSION imcu_rows;		/* in the whole image */
+  JDIMENSION band_rows;		/* iMCU rows kept per band */
+  int imcu_height;		/* pixel rows per iMCU row */
+} jpgdbands;
+
+/*
+ * Returns the offset of the image height in the frame header, or 0.
+ */
+
+static size_t
+frame_height_offset (const u_char *data, size_t len)
+{
+  size_t off = 2;		/* after SOI */
+  int marker;
+
+  while (off + 4 <= len) {
+    if (data[off] != 0xFF)
+      return 0;
+    while (off + 4 <= len && data[off + 1] == 0xFF)
+      off++;			/* fill bytes */
+    marker = data[off + 1];
+    if (marker >= 0xC0 && marker <= 0xCF &&
+	marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+      return off + 7 <= len ? off + 5 : 0;
+    if (marker == 0xDA)		/* SOS, no frame seen */
+      return 0;
+    off += 2 + ((size_t) data[off + 2] << 8 | data[off + 3]);
+  }
+
+  return 0;
+}
+
+/* Band decompressors see no scan data, they must not complain about it */
+
+METHODDEF(void)
+ignore_message (j_common_ptr cinfo, int msg_level)
+{
+}
+
+/*
+ * Takes the place of the coefficient controller's decompress_data in a
+ * band decompressor, see decompress_data in jdcoefct.c.
+ */
+
+METHODDEF(int)
+decompress_band (j_decompress_ptr cinfo, JSAMPIMAGE output_buf)
+{
+  jpgcoeffs *jc = ((jpgsteg *) cinfo->client_data)->coeffs;
+  JDIMENSION last_iMCU_row = cinfo->total_iMCU_rows - 1;
+  JDIMENSION block_num, row;
+  int ci, block_row, block_rows;
+  JBLOCKROW buffer_ptr;
+  JSAMPARRAY output_ptr;
+  JDIMENSION output_col;
+  jpeg_component_info *compptr;
+  inverse_DCT_method_ptr inverse_DCT;
+
+  for (ci = 0, compptr = cinfo->comp_info; ci < cinfo->num_components;
+       ci++, compptr++) {
+    if (! compptr->component_needed)
+      continue;
+    /* Count non-dummy DCT block rows in this iMCU row. */
+    if (cinfo->output_iMCU_row < last_iMCU_row)
+      block_rows = compptr->v_samp_factor;
+    else {
+      block_rows = (int) (compptr->height_in_blocks % compptr->v_samp_factor);
+      if (block_rows == 0) block_rows = compptr->v_samp_factor;
+    }
+    row = (jc->mcu_row0 + cinfo->output_iMCU_row) * compptr->v_samp_factor;
+    inverse_DCT = cinfo->idct->inverse_DCT[ci];
+    output_ptr = output_buf[ci];
+    for (block_row = 0; block_row < block_rows; block_row++) {
+      buffer_ptr = jc->image_rows[ci][row + block_row];
+      output_col = 0;
+      for (block_num = 0; block_num < compptr->width_in_blocks; block_num++) {
+	(*inverse_DCT) (cinfo, compptr, (JCOEFPTR) buffer_ptr,
+			output_ptr, output_col);
+	buffer_ptr++;
+	output_col += compptr->DCT_scaled_size;
+      }
+      output_ptr += compptr->DCT_scaled_size;
+    }
+  }
+
+  if (++(cinfo->output_iMCU_row) < cinfo->total_iMCU_rows)
+    return JPEG_ROW_COMPLETED;
+  return JPEG_SCAN_COMPLETED;
+}
+
+static void
+decompress_band_job (void *arg, int i)
+{
+  jpgdbands *bands = arg;
+  image *image = bands->image;
+  jpgcoeffs *bjc;
+  jpgsteg steg;
+  j_decompress_ptr cinfo;
+  JSAMPROW row_pointer[1];
+  u_char *scratch;
+  u_char *header;
+  JDIMENSION first, last, start, end, height, y;
+  int row_stride = image->x * image->depth;
+
+  /* iMCU rows kept, and those decompressed */
+  first = (JDIMENSION) i * bands->band_rows;
+  last = first + bands->band_rows;
+  if (last > bands->imcu_rows)
+    last = bands->imcu_rows;
+  start = first > 0 ? first - 1 : 0;
+  end = last < bands->imcu_rows ? last + 1 : last;
+
+  height = end * bands->imcu_height;
+  if (height > (JDIMENSION) image->y)
+    height = image->y;
+  height -= start * bands->imcu_height;
+
+  /* The frame of the band, and an EOI right after the scan header */
+  header = checkedmalloc(bands->header_len + 2);
+  memcpy(header, bands->header, bands->header_len);
+  header[bands->height_off] = (u_char) (height >> 8);
+  header[bands->height_off + 1] = (u_char) height;
+  header[bands->header_len] = 0xFF;
+  header[bands->header_len + 1] = JPEG_EOI;
+
+  init_state(&steg, JPEG_CAPTURING, 0, NULL);
+  bjc = checkedmalloc(sizeof(*bjc));
+  memset(bjc, 0, sizeof(*bjc));
+  memcpy(bjc->image_rows, bands->jc->image_rows, sizeof(bjc->image_rows));
+  bjc->mcu_row0 = start;
+  steg.coeffs = bjc;
+  cinfo = &bjc->dinfo;
+
+  cinfo->err = jpeg_std_error(&bjc->jerr);
+  bjc->jerr.emit_message = ignore_message;
+  jpeg_create_decompress(cinfo);
+  cinfo->client_data = &steg;
+
+  jpeg_mem_src(cinfo, header, bands->header_len + 2);
+  (void) jpeg_read_header(cinfo, TRUE);
+  (void) jpeg_start_decompress(cinfo);
+  cinfo->coef->decompress_data = decompress_band;
+
+  /* The rows of the iMCU row above are only there for upsampling */
+  scratch = checkedmalloc(row_stride);
+  y = start * bands->imcu_height;
+  end = last * bands->imcu_height;
+  if (end > (JDIMENSION) image->y)
+    end = image->y;
+  first *= bands->imcu_height;
+  for (; y < end; y++) {
+    row_pointer[0] = y < first ? scratch : &image->img[y * row_stride];
+    (void) jpeg_read_scanlines(cinfo, row_pointer, 1);
+  }
+
+  jpeg_destroy_decompress(cinfo);
+  free(scratch);
+  free(bjc);
+  free(header);
+}
+
+/*
+ * Decompresses the JPEG in memory in bands.  Returns NULL if that
+ * cannot give the same pixels as read_JPEG.
+ */
+
+static image *
+read_JPEG_bands (const u_char *data, size_t len)
+{
+  image *image;
+  jpgcoeffs *jc;
+  jpgdbands bands;
+  struct jpeg_decompress_struct *dinfo;
+  jpeg_component_info *compptr;
+  JDIMENSION row, rows;
+  int ci, k, nbands;
+
+  jc = checkedmalloc(sizeof(*jc));
+  memset(jc, 0, sizeof(*jc));
+  dinfo = &jc->dinfo;
+
+  dinfo->err = jpeg_std_error(&jc->jerr);
+  jpeg_create_decompress(dinfo);
+  dinfo->client_data = NULL;
+
+  jpeg_mem_src(dinfo, data, len);
+  (void) jpeg_read_header(dinfo, TRUE);
+
+  bands.header = data;
+  bands.header_len = (const u_char *) dinfo->src->next_input_byte - data;
+  bands.height_off = frame_height_offset(data, bands.header_len);
+  bands.imcu_rows = dinfo->total_iMCU_rows;
+  if (bands.height_off == 0 || bands.imcu_rows < 2)
+    goto fail;
+
+  jpeg_calc_output_dimensions(dinfo);
+  jc->arrays = jpeg_read_coefficients(dinfo);
+
+  /* Block smoothing of incomplete progressive JPEGs spans the bands */
+  if (dinfo->progressive_mode && dinfo->do_block_smoothing)
+    for (ci = 0; ci < dinfo->num_components; ci++)
+      for (k = 1; k <= 5; k++)
+	if (dinfo->coef_bits[ci][0] >= 0 && dinfo->coef_bits[ci][k] != 0)
+	  goto fail;
+
+  /* The arrays are in memory, the bands keep pointers to all rows */
+  for (ci = 0, compptr = dinfo->comp_info; ci < dinfo->num_components;
+       ci++, compptr++) {
+    rows = (JDIMENSION) compptr->v_samp_factor * dinfo->total_iMCU_rows;
+    jc->image_rows[ci] = checkedmalloc(rows * sizeof(JBLOCKROW));
+    for (row = 0; row < rows; row += compptr->v_samp_factor) {
+      JBLOCKARRAY buffer = (*dinfo->mem->access_virt_barray)
+	((j_common_ptr) dinfo, jc->arrays[ci], row,
+	 (JDIMENSION) compptr->v_samp_factor, FALSE);
+      for (k = 0; k < compptr->v_samp_factor; k++)
+	jc->image_rows[ci][row + k] = buffer[k];
+    }
+  }
+
+  image = checkedmalloc(sizeof(*image));
+  memset(image, 0, sizeof(*image));
+  image->x = dinfo->output_width;
+  image->y = dinfo->output_height;
+  image->depth = dinfo->output_components;
+  image->max = 255;
+  image->img = checkedmalloc(dinfo->output_width * dinfo->output_height *
+			     dinfo->output_components);
+
+  nbands = jobs_threads() * 4;
+  if ((JDIMENSION) nbands > bands.imcu_rows)
+    nbands = (int) bands.imcu_rows;
+  bands.jc = jc;
+  bands.image = image;
+  bands.band_rows = (bands.imcu_rows + nbands - 1) / nbands;
+  bands.imcu_height = dinfo->max_v_samp_factor * dinfo->min_DCT_scaled_size;
+  nbands = (int) ((bands.imcu_rows + bands.band_rows - 1) / bands.band_rows);
+  jobs_run(nbands, decompress_band_job, &bands);
+
+  for (ci = 0; ci < dinfo->num_components; ci++)
+    free(jc->image_rows[ci]);
+  jpeg_destroy_decompress(dinfo);
+  free(jc);
+
+  return image;
+
+ fail:
+  jpeg_destroy_decompress(dinfo);
+  free(jc);
+  return NULL;
+}
+
+
 /*
  * Sample routine for JPEG decompression.  We assume that the source file name
  * is passed in.  We want to return 1 on success, 0 on error.
  */
 
 
-image *
-read_JPEG_file (FILE *infile)
+static image *
+read_JPEG (FILE *infile, const u_char *data, size_t len, int flags)
 {
   /* This struct contains the JPEG decompression parameters and pointers to
    * working space (which is allocated as needed by the JPEG library).
@@ -636,7 +1510,21 @@ read_JPEG_file (FILE *infile)
   JSAMPARRAY buffer;		/* Output row buffer */
   int row_stride;		/* physical row width in output buffer */
 
-  init_state(JPEG_READING, 0, NULL);
+  /* When the JPEG is written back, we never need its pixels */
+  if (flags & STEG_NATIVE)
+    return read_JPEG_coeffs(infile, data, len);
+
+  /* Retrieval needs the coefficients only, not the decoded pixels */
+  if (flags & STEG_RETRIEVE) {
+    image = read_JPEG_coeffs(infile, data, len);
+    free_JPEG_coeffs(image);
+    return image;
+  }
+
+  /* With threads, a JPEG in memory is decompressed in bands */
+  if (data != NULL && jobs_threads() > 1 && !spill_limit() &&
+      (image = read_JPEG_bands(data, len)) != NULL)
+    return image;
 
   image = checkedmalloc(sizeof(*image));
   memset(image, 0, sizeof(*image));
@@ -646,10 +1534,16 @@ read_JPEG_file (FILE *infile)
   cinfo.err = jpeg_std_error(&jerr);
   /* Now we can initialize the JPEG decompression object. */
   jpeg_create_decompress(&cinfo);
+  limit_memory((j_common_ptr) &cinfo);
+  /* The pixels are all we want, the coefficients are not collected */
+  cinfo.client_data = NULL;
 
   /* Step 2: specify data source (eg, a file) */
 
-  jpeg_stdio_src(&cinfo, infile);
+  if (infile != NULL)
+    jpeg_stdio_src(&cinfo, infile);
+  else
+    jpeg_mem_src(&cinfo, data, len);
 
   /* Step 3: read file parameters with jpeg_read_header() */
 
@@ -724,12 +1618,22 @@ read_JPEG_file (FILE *infile)
   /* This is an important step since it will release a good deal of memory. */
   jpeg_destroy_decompress(&cinfo);
 
-  image->bitmap = finish_state();
-
   /* And we're done! */
   return image;
 }
 
+image *
+read_JPEG_file (FILE *infile, int flags)
+{
+  return read_JPEG(infile, NULL, 0, flags);
+}
+
+image *
+read_JPEG_mem (const u_char *data, size_t len, int flags)
+{
+  return read_JPEG(NULL, data, len, flags);
+}
+
 
 /*
  * SOME FINE POINTS:
@@ -758,13 +1662,13 @@ read_JPEG_file (FILE *infile)
 
 /* Expanded data destination object for dummy output */
 
+#define BUFSIZE	256
+
 typedef struct {
   struct jpeg_destination_mgr pub; /* public fields */
-} my_destination_mgr;
 
-#define BUFSIZE	256
-
-char dummy_buf[BUFSIZE];
+  JOCTET buffer[BUFSIZE];	/* output is overwritten, one per object */
+} my_destination_mgr;
 
 typedef my_destination_mgr * my_dest_ptr;
 
@@ -773,7 +1677,7 @@ init_destination (j_compress_ptr cinfo)
 {
   my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
 
-  dest->pub.next_output_byte = dummy_buf;
+  dest->pub.next_output_byte = dest->buffer;
   dest->pub.free_in_buffer = BUFSIZE;
 }
 
@@ -782,7 +1686,7 @@ empty_output_buffer (j_compress_ptr cinfo)
 {
   my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
 
-  dest->pub.next_output_byte = dummy_buf;
+  dest->pub.next_output_byte = dest->buffer;
   dest->pub.free_in_buffer = BUFSIZE;
 
   return TRUE;
@@ -815,3 +1719,144 @@ jpeg_dummy_dest (j_compress_ptr cinfo)
   dest->pub.empty_output_buffer = empty_output_buffer;
   dest->pub.term_destination = term_destination;
 }
+
+/* Data source object for a JPEG image that is already in memory.
+ * The whole image is one buffer, so there is nothing to fill.
+ */
+
+METHODDEF(void)
+init_mem_source (j_decompress_ptr cinfo)
+{
+}
+
+METHODDEF(boolean)
+fill_mem_input_buffer (j_decompress_ptr cinfo)
+{
+  static const JOCTET eoi_buf[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+  /* Running out of data means the image is truncated.  Insert a fake
+   * EOI marker, as the stdio source does at end of file.
+   */
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  cinfo->src->next_input_byte = eoi_buf;
+  cinfo->src->bytes_in_buffer = 2;
+
+  return TRUE;
+}
+
+METHODDEF(void)
+skip_mem_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_source_mgr *src = cinfo->src;
+
+  if (num_bytes > 0) {
+    while (num_bytes > (long) src->bytes_in_buffer) {
+      num_bytes -= (long) src->bytes_in_buffer;
+      (void) fill_mem_input_buffer(cinfo);
+    }
+    src->next_input_byte += (size_t) num_bytes;
+    src->bytes_in_buffer -= (size_t) num_bytes;
+  }
+}
+
+METHODDEF(void)
+term_mem_source (j_decompress_ptr cinfo)
+{
+}
+
+void
+jpeg_mem_src (j_decompress_ptr cinfo, const u_char *data, size_t len)
+{
+  struct jpeg_source_mgr *src;
+
+  if (cinfo->src == NULL) {	/* first time for this JPEG object? */
+    cinfo->src = (struct jpeg_source_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				  sizeof(struct jpeg_source_mgr));
+  }
+
+  src = cinfo->src;
+  src->init_source = init_mem_source;
+  src->fill_input_buffer = fill_mem_input_buffer;
+  src->skip_input_data = skip_mem_input_data;
+  src->resync_to_restart = jpeg_resync_to_restart; /* use default method */
+  src->term_source = term_mem_source;
+  src->next_input_byte = (const JOCTET *) data;
+  src->bytes_in_buffer = len;
+}
+
+/* Data destination object that collects the JPEG image in a growing
+ * malloc'd buffer.
+ */
+
+#define MEM_DEST_INITIAL	65536
+
+typedef struct {
+  struct jpeg_destination_mgr pub; /* public fields */
+
+  u_char **data;		/* where to return the buffer ... */
+  size_t *len;			/* ... and the number of bytes in it */
+  JOCTET *buffer;
+  size_t size;
+} mem_destination_mgr;
+
+typedef mem_destination_mgr * mem_dest_ptr;
+
+METHODDEF(void)
+init_mem_destination (j_compress_ptr cinfo)
+{
+  mem_dest_ptr dest = (mem_dest_ptr) cinfo->dest;
+
+  dest->buffer = (JOCTET *) checkedmalloc(MEM_DEST_INITIAL);
+  dest->size = MEM_DEST_INITIAL;
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->size;
+}
+
+METHODDEF(boolean)
+empty_mem_output_buffer (j_compress_ptr cinfo)
+{
+  mem_dest_ptr dest = (mem_dest_ptr) cinfo->dest;
+  JOCTET *p;
+
+  /* The buffer is full, double it */
+  if ((p = (JOCTET *) realloc(dest->buffer, dest->size * 2)) == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+  dest->buffer = p;
+  dest->pub.next_output_byte = p + dest->size;
+  dest->pub.free_in_buffer = dest->size;
+  dest->size *= 2;
+
+  return TRUE;
+}
+
+METHODDEF(void)
+term_mem_destination (j_compress_ptr cinfo)
+{
+  mem_dest_ptr dest = (mem_dest_ptr) cinfo->dest;
+
+  *dest->data = (u_char *) dest->buffer;
+  *dest->len = dest->size - dest->pub.free_in_buffer;
+}
+
+void
+jpeg_mem_dest (j_compress_ptr cinfo, u_char **data, size_t *len)
+{
+  mem_dest_ptr dest;
+
+  /* The same caveat as for jpeg_dummy_dest applies. */
+  if (cinfo->dest == NULL) {	/* first time for this JPEG object? */
+    cinfo->dest = (struct jpeg_destination_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				  sizeof(mem_destination_mgr));
+  }
+
+  dest = (mem_dest_ptr) cinfo->dest;
+  dest->pub.init_destination = init_mem_destination;
+  dest->pub.empty_output_buffer = empty_mem_output_buffer;
+  dest->pub.term_destination = term_mem_destination;
+  dest->data = data;
+  dest->len = len;
+  dest->buffer = NULL;
+  dest->size = 0;
+}
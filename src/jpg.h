@@ -35,22 +35,29 @@
 #define JPG_THRES_LOW	0x04
 #define JPG_THRES_MIN	0x03
 
-void init_JPEG_handler(char *parameters);
+int init_JPEG_handler(char *parameters);
 
 int preserve_jpg(bitmap *, int);
 
 void write_JPEG_file (FILE *outfile, image *image);
-image *read_JPEG_file (FILE *infile);
+image *read_JPEG_file (FILE *infile, int flags);
+void write_JPEG_mem (image *image, u_char **data, size_t *len);
+image *read_JPEG_mem (const u_char *data, size_t len, int flags);
+
+image *read_JPEG_coeffs(FILE *infile, const u_char *data, size_t len);
+void free_JPEG_coeffs(image *image);
 
 void bitmap_from_jpg(bitmap *bitmap, image *image, int flags);
 void bitmap_to_jpg(image *image, bitmap *bitmap, int flags);
 
 bitmap *compress_JPEG(image *image);
+void recompress_JPEG(image *image, bitmap *bitmap, int flags);
 
 extern handler jpg_handler;
 
 #define JPEG_READING	0
 #define JPEG_WRITING	1
+#define JPEG_CAPTURING	2	/* blocks are stored, not looked at */
 
 #endif /* _JPG_H */
 
@@ -65,24 +65,34 @@
 #include "pnm.h"
 #include "jpg.h"
 #include "iterator.h"
+#include "jobs.h"
+#include "spill.h"
 
 #ifndef MAP_FAILED
 /* Some Linux systems are missing this */
 #define MAP_FAILED	(void *)-1
 #endif /* MAP_FAILED */
 
-static int steg_err_buf[CODEBITS];
-static int steg_err_cnt;
-static int steg_errors;
-static int steg_encoded;
+/*
+ * The counters of a single embedding.  Every seed that is tried gets its
+ * own, so that the seeds can be tried in parallel.
+ */
+
+typedef struct _stegstate {
+	int err_buf[CODEBITS];	/* bits changed in the current ECC block */
+	int err_cnt;
+	int errors;		/* locked bits left as errors in the block */
+	int encoded;		/* bits left in the current ECC block */
+
+	int count;		/* bits embedded */
+	int mis;		/* bits that had to be changed */
+	int mod;		/* detectability of the changes */
+} stegstate;
 
 static int steg_offset[MAX_SEEK];
 int steg_foil;
 int steg_foilfail;
 
-static int steg_count;
-static int steg_mis;
-static int steg_mod;
 static int steg_data;
 
 /* Exported variables */
@@ -93,6 +103,7 @@ int steg_stat;
 
 handler *handlers[] = {
 	&pnm_handler,
+	&pgm_handler,
 	&jpg_handler
 };
 
@@ -135,15 +146,15 @@ checkedmalloc(size_t n)
  * untouched.
  */
 
-void
-steg_adjust_errors(bitmap *bitmap, int flags)
+static void
+steg_adjust_errors(stegstate *st, bitmap *bitmap, int flags)
 {
 	int i, j, n, many, flag;
 	int priority[ERRORBITS], detect[ERRORBITS];
 
-	many = ERRORBITS - steg_errors;
-	for (j = 0; j < many && j < steg_err_cnt; j++) {
-		priority[j] = steg_err_buf[j];
+	many = ERRORBITS - st->errors;
+	for (j = 0; j < many && j < st->err_cnt; j++) {
+		priority[j] = st->err_buf[j];
 		detect[j] = bitmap->detect[priority[j]];
 	}
 
@@ -157,19 +168,20 @@ steg_adjust_errors(bitmap *bitmap, int flags)
 			}
 	} while (flag);
 
-	for (i = j; i < steg_err_cnt; i++) {
+	for (i = j; i < st->err_cnt; i++) {
 		for (n = 0; n < j; n++)
-			if (detect[n] < bitmap->detect[steg_err_buf[i]])
+			if (detect[n] < bitmap->detect[st->err_buf[i]])
 				break;
+		/* The last one drops out */
 		if (n < j - 1) {
 			memmove(detect + n + 1, detect + n,
-				(j - n) * sizeof(int));
+				(j - n - 1) * sizeof(int));
 			memmove(priority + n + 1, priority + n,
-				(j - n) * sizeof(int));
+				(j - n - 1) * sizeof(int));
 		}
 		if (n < j) {
-			priority[n] = steg_err_buf[i];
-			detect[n] = bitmap->detect[steg_err_buf[i]];
+			priority[n] = st->err_buf[i];
+			detect[n] = bitmap->detect[st->err_buf[i]];
 		}
 	}
 
@@ -181,18 +193,63 @@ steg_adjust_errors(bitmap *bitmap, int flags)
 			else
 				WRITE_BIT(bitmap->bitmap, i, 1);
 		}
-		steg_mis--;
-		steg_mod -= detect[i];
+		st->mis--;
+		st->mod -= detect[i];
 	}
 }
 
-int
-steg_embedchunk(bitmap *bitmap, iterator *iter,
+/*
+ * Puts the data bit at position i of the bitmap, where the cover has
+ * bit, which may be locked.  Returns 0 if that is not possible.
+ */
+
+static int
+steg_embedbit(stegstate *st, bitmap *bitmap, int i, int bit, int locked,
+	      int data, int embed)
+{
+	u_int32_t val;
+
+	if ((embed & STEG_ERROR) && !st->encoded) {
+		if (st->err_cnt > 0)
+			steg_adjust_errors(st, bitmap, embed);
+		st->encoded = CODEBITS;
+		st->errors = 0;
+		st->err_cnt = 0;
+		memset(st->err_buf, 0, sizeof(st->err_buf));
+	}
+	st->encoded--;
+
+	val = bit ^ data;
+	st->count++;
+	if (val == 1) {
+		st->mod += bitmap->detect[i];
+		st->mis++;
+	}
+
+	/* Check if we are allowed to change a bit here */
+	if ((val == 1) && locked) {
+		if (!(embed & STEG_ERROR) || (++st->errors > 3))
+			return 0;
+		val = 2;
+	}
+
+	/* Store the bits we changed in error encoding mode */
+	if ((embed & STEG_ERROR) && val == 1)
+		st->err_buf[st->err_cnt++] = i;
+
+	if (val != 2 && (embed & STEG_EMBED)) {
+		WRITE_BIT(bitmap->locked, i, 1);
+		WRITE_BIT(bitmap->bitmap, i, data);
+	}
+
+	return 1;
+}
+
+static int
+steg_embedchunk(stegstate *st, bitmap *bitmap, iterator *iter,
 		u_int32_t data, int bits, int embed)
 {
 	int i = ITERATOR_CURRENT(iter);
-	u_int8_t bit;
-	u_int32_t val;
 	u_char *pbits, *plocked;
 	int nbits;
 
@@ -201,59 +258,166 @@ steg_embedchunk(bitmap *bitmap, iterator *iter,
 	nbits = bitmap->bits;
 
 	while (i < nbits && bits) {
-		if ((embed & STEG_ERROR) && !steg_encoded) {
-			if (steg_err_cnt > 0)
-				steg_adjust_errors(bitmap, embed);
-			steg_encoded = CODEBITS;
-			steg_errors = 0;
-			steg_err_cnt = 0;
-			memset(steg_err_buf, 0, sizeof(steg_err_buf));
-		}
-		steg_encoded--;
-
-		bit = TEST_BIT(pbits, i) ? 1 : 0;
-		val = bit ^ (data & 1);
-		steg_count++;
-		if (val == 1) {
-			steg_mod += bitmap->detect[i];
-			steg_mis++;
-		}
+		if (!steg_embedbit(st, bitmap, i,
+				   TEST_BIT(pbits, i) ? 1 : 0,
+				   TEST_BIT(plocked, i) ? 1 : 0,
+				   data & 1, embed))
+			return 0;
 
-		/* Check if we are allowed to change a bit here */
-		if ((val == 1) && TEST_BIT(plocked, i)) {
-			if (!(embed & STEG_ERROR) || (++steg_errors > 3))
-				return 0;
-			val = 2;
-		}
+		data >>= 1;
+		bits--;
 
-		/* Store the bits we changed in error encoding mode */
-		if ((embed & STEG_ERROR) && val == 1)
-			steg_err_buf[steg_err_cnt++] = i;
+		i = iterator_next(iter, bitmap);
+	}
 
-		if (val != 2 && (embed & STEG_EMBED)) {
-			WRITE_BIT(plocked, i, 1);
-      			WRITE_BIT(pbits, i, data & 1);
-		}
+	return 1;
+}
 
-		data >>= 1;
-		bits--;
+#ifdef __GNUC__
+#define POPCOUNT(x)	__builtin_popcount(x)
+#else
+static int
+POPCOUNT(u_int32_t x)
+{
+	int n;
+
+	for (n = 0; x; n++)
+		x &= x - 1;
+
+	return n;
+}
+#endif /* __GNUC__ */
+
+/*
+ * Does what steg_embedchunk does for a byte in a dry run without error
+ * correction, where only the cost matters.  The bits of the cover at the
+ * positions of the byte are gathered first, then the changed ones are
+ * found and counted at once.
+ */
+
+static int
+steg_costbyte(stegstate *st, bitmap *bitmap, iterator *iter, u_int32_t data)
+{
+	int off[8], i = ITERATOR_CURRENT(iter);
+	u_int32_t cover = 0, locked = 0, diff;
+	int n, nbits = bitmap->bits;
+
+	for (n = 0; n < 8 && i < nbits; n++) {
+		off[n] = i;
+		cover |= ((bitmap->bitmap[i / 8] >> (i & 7)) & 1) << n;
+		locked |= ((bitmap->locked[i / 8] >> (i & 7)) & 1) << n;
 
 		i = iterator_next(iter, bitmap);
 	}
 
+	diff = (cover ^ data) & ((1 << n) - 1);
+	st->count += n;
+
+	/* A locked bit that would have to change fails the seed */
+	if (diff & locked)
+		return 0;
+
+	st->mis += POPCOUNT(diff);
+	for (n = 0; diff; n++, diff >>= 1)
+		if (diff & 1)
+			st->mod += bitmap->detect[off[n]];
+
 	return 1;
 }
 
+/*
+ * Every trial of the seed search starts from the same iterator, so the
+ * header with the seed goes to the same bits for every seed.  Where they
+ * are and what the cover has there is only looked up once.
+ */
+
+struct steghead {
+	int nbits;		/* header bits that fit into the bitmap */
+	struct {
+		int off;
+		u_char bit;
+		u_char locked;
+	} *bits;
+	iterator iter;		/* the iterator after the header */
+};
+
+/* What every trial of the seed search starts from */
+
+struct stegsearch {
+	bitmap *bitmap;
+	iterator *iter;
+	struct arc4_stream *as;
+	u_char *data;
+	int datalen;
+	int flags;
+	int siterstart;
+	stegres *results;	/* one for every seed */
+	struct steghead head;
+	volatile int ceiling;	/* lowest cost so far, or -1 */
+	int bound;		/* stop seeds above the ceiling */
+};
+
+static void
+steg_headinit(struct steghead *head, bitmap *bitmap, iterator *iter,
+	      int flags)
+{
+	int i, k, len = 4;
+
+	encode_data(NULL, &len, NULL, flags);
+	head->bits = checkedmalloc(len * 8 * sizeof(*head->bits));
+	head->iter = *iter;
+
+	i = ITERATOR_CURRENT(&head->iter);
+	for (k = 0; k < len * 8 && i < bitmap->bits; k++) {
+		head->bits[k].off = i;
+		head->bits[k].bit = TEST_BIT(bitmap->bitmap, i) ? 1 : 0;
+		head->bits[k].locked = TEST_BIT(bitmap->locked, i) ? 1 : 0;
+
+		i = iterator_next(&head->iter, bitmap);
+	}
+	head->nbits = k;
+}
+
+/*
+ * The least that an embedding can cost in the end.  Changed bits only
+ * ever add to the cost, but in error correcting mode steg_adjust_errors
+ * may still take back up to ERRORBITS bits of the current block, each
+ * worth at most 1 + the highest detectability of 2.
+ */
+
+static int
+steg_mincost(stegstate *st, int embed)
+{
+	int credit = 0;
+
+	if (embed & STEG_ERROR) {
+		credit = ERRORBITS - st->errors;
+		if (credit > st->err_cnt)
+			credit = st->err_cnt;
+		credit *= 3;
+	}
+
+	return (st->mis + st->mod - credit);
+}
+
+/*
+ * Embeds the data, or with just a dry run tells what that would cost.
+ * For the dry runs of a seed search, search is not NULL: the header bits
+ * come from its cache, and if it has a ceiling, the run stops with
+ * STEG_ERR_COST as soon as the cost is sure to end up above it.
+ */
+
 stegres
 steg_embed(bitmap *bitmap, iterator *iter, struct arc4_stream *as,
-	   u_char *data, u_int datalen, u_int16_t seed, int embed)
+	   u_char *data, u_int datalen, u_int16_t seed, int embed,
+	   struct stegsearch *search)
 {
-	int i, len;
+	int i, len, ok;
 	u_char tmpbuf[4], *encbuf;
 	stegres result;
+	stegstate st;
 
-	steg_count = steg_mis = steg_mod = 0;
-
+	memset(&st, 0, sizeof(st));
 	memset(&result, 0, sizeof(result));
 
 	if (bitmap->bits / (datalen * 8) < 2) {
@@ -267,10 +431,6 @@ steg_embed(bitmap *bitmap, iterator *iter, struct arc4_stream *as,
 		fprintf(stderr, "Embedding data: %d in %d\n",
 			datalen * 8, bitmap->bits);
 
-	/* Clear error counter */
-	steg_encoded = 0;
-	steg_err_cnt = 0;
-
 	/* Encode the seed and datalen */
 	tmpbuf[0] = seed & 0xff;
 	tmpbuf[1] = seed >> 8;
@@ -281,24 +441,35 @@ steg_embed(bitmap *bitmap, iterator *iter, struct arc4_stream *as,
 	len = 4;
 	encbuf = encode_data (tmpbuf, &len, as, embed);
 
-	for (i = 0; i < len; i++)
-		if (!steg_embedchunk(bitmap, iter, encbuf[i], 8, embed)) {
-			free (encbuf);
+	if (search != NULL) {
+		struct steghead *head = &search->head;
 
-			/* If we use error correction or a bit in the seed
-			 * was locked, we can go on, otherwise we have to fail.
-			 */
-			if ((embed & STEG_ERROR) ||
-			    steg_count < 16 /* XXX */)
-				result.error = STEG_ERR_HEADER;
-			else
-				result.error = STEG_ERR_PERM;
-			return result;
-		}
+		for (ok = 1, i = 0; ok && i < head->nbits; i++)
+			ok = steg_embedbit(&st, bitmap, head->bits[i].off,
+					   head->bits[i].bit,
+					   head->bits[i].locked,
+					   (encbuf[i / 8] >> (i % 8)) & 1,
+					   embed);
+		*iter = head->iter;
+	} else
+		for (ok = 1, i = 0; ok && i < len; i++)
+			ok = steg_embedchunk(&st, bitmap, iter,
+					     encbuf[i], 8, embed);
 	free (encbuf);
+	if (!ok) {
+		/* If we use error correction or a bit in the seed
+		 * was locked, we can go on, otherwise we have to fail.
+		 */
+		if ((embed & STEG_ERROR) ||
+		    st.count < 16 /* XXX */)
+			result.error = STEG_ERR_HEADER;
+		else
+			result.error = STEG_ERR_PERM;
+		return result;
+	}
 
 	/* Clear error counter again, a new ECC block starts */
-	steg_encoded = 0;
+	st.encoded = 0;
 
 	iterator_seed(iter, bitmap, seed);
 
@@ -308,30 +479,43 @@ steg_embed(bitmap *bitmap, iterator *iter, struct arc4_stream *as,
 		u_int32_t tmp = *data++;
 		datalen--;
 
-		if (!steg_embedchunk(bitmap, iter, tmp, 8, embed)) {
+		/* Dry runs of a search only need to count */
+		if (search != NULL && !(embed & STEG_ERROR))
+			ok = steg_costbyte(&st, bitmap, iter, tmp);
+		else
+			ok = steg_embedchunk(&st, bitmap, iter, tmp, 8, embed);
+		if (!ok) {
 			result.error = STEG_ERR_BODY;
 			return result;
 		}
+
+		if (search != NULL && search->bound &&
+		    search->ceiling != -1 &&
+		    steg_mincost(&st, embed) > search->ceiling) {
+			result.error = STEG_ERR_COST;
+			return result;
+		}
 	}
 
 	/* Final error adjustion after end */
-	if ((embed & STEG_ERROR) && steg_err_cnt > 0)
-	  steg_adjust_errors(bitmap, embed);
+	if ((embed & STEG_ERROR) && st.err_cnt > 0)
+	  steg_adjust_errors(&st, bitmap, embed);
 
 	if (embed & STEG_EMBED) {
 		fprintf(stderr, "Bits embedded: %d, "
 			"changed: %d(%2.1f%%)[%2.1f%%], "
 			"bias: %d, tot: %d, skip: %d\n",
-			steg_count, steg_mis,
-			(float) 100 * steg_mis/steg_count,
-			(float) 100 * steg_mis/steg_data, /* normalized */
-			steg_mod,
+			st.count, st.mis,
+			(float) 100 * st.mis/st.count,
+			(float) 100 * st.mis/steg_data, /* normalized */
+			st.mod,
 			ITERATOR_CURRENT(iter),
-			ITERATOR_CURRENT(iter) - steg_count);
+			ITERATOR_CURRENT(iter) - st.count);
 	}
 
-	result.changed = steg_mis;
-	result.bias = steg_mod;
+	result.count = st.count;
+	result.changed = st.mis;
+	result.bias = st.mod;
 
 	return result;
 }
@@ -410,6 +594,50 @@ steg_retrieve(int *len, bitmap *bitmap, iterator *iter, struct arc4_stream *as,
 	return buf;
 }
 
+/* Lowers the ceiling to cost, even if other threads change it as well */
+
+static void
+steg_lowerceiling(volatile int *ceiling, int cost)
+{
+	int old;
+
+	while ((old = *ceiling) == -1 || cost < old) {
+#ifdef __GNUC__
+		if (__sync_bool_compare_and_swap(ceiling, old, cost))
+			break;
+#else
+		*ceiling = cost;
+		break;
+#endif /* __GNUC__ */
+	}
+}
+
+static void
+steg_tryseed(void *arg, int i)
+{
+	struct stegsearch *ss = arg;
+	struct arc4_stream tas = *ss->as;
+	iterator titer = *ss->iter;
+	stegres *result = &ss->results[i];
+
+	*result = steg_embed(ss->bitmap, &titer, &tas,
+			     ss->data, ss->datalen, ss->siterstart + i,
+			     ss->flags, ss);
+	if (ss->bound && !result->error)
+		steg_lowerceiling(&ss->ceiling,
+				  result->changed + result->bias);
+}
+
+/*
+ * Tries all seeds on the threads we have, then picks the one that
+ * changes the fewest bits.  The results are looked at in the order of
+ * the seeds, so the lowest of equally good seeds wins as it always did.
+ * A seed is given up once it costs more than the best one found so far,
+ * on any thread.  As equal costs are never given up, that can not
+ * change the choice; it only hides the progress lines of seeds that
+ * would have been better than the seeds before them.
+ */
+
 int
 steg_find(bitmap *bitmap, iterator *iter, struct arc4_stream *as,
 	  int siter, int siterstart,
@@ -417,8 +645,7 @@ steg_find(bitmap *bitmap, iterator *iter, struct arc4_stream *as,
 {
 	int half;
 	int j, i, size = 0;
-	struct arc4_stream tas;
-	iterator titer;
+	struct stegsearch ss;
 	u_int16_t *chstats = NULL;
 	stegres result;
 
@@ -438,14 +665,28 @@ steg_find(bitmap *bitmap, iterator *iter, struct arc4_stream *as,
 		fprintf(stderr, "Finding best embedding...\n");
 		int changed = -1, chmin = -1, chmax = -1; j = -STEG_ERR_HEADER;
 
+		ss.bitmap = bitmap;
+		ss.iter = iter;
+		ss.as = as;
+		ss.data = data;
+		ss.datalen = datalen;
+		ss.flags = flags;
+		ss.siterstart = siterstart;
+		ss.results = checkedmalloc((siter - siterstart) * sizeof(stegres));
+		ss.ceiling = -1;
+		/* The statistics want to know the cost of every seed */
+		ss.bound = !steg_stat;
+		steg_headinit(&ss.head, bitmap, iter, flags);
+		jobs_run(siter - siterstart, steg_tryseed, &ss);
+		free(ss.head.bits);
+
 		for (i = siterstart; i < siter; i++) {
-			titer = *iter;
-			tas = *as;
-			result = steg_embed(bitmap, &titer, &tas,
-					 data, datalen, i, flags);
+			result = ss.results[i - siterstart];
 			/* Seed does not effect any more */
-			if (result.error == STEG_ERR_PERM)
+			if (result.error == STEG_ERR_PERM) {
+				free(ss.results);
 				return -result.error;
+			}
 			else if (result.error)
 				continue;
 
@@ -468,14 +709,15 @@ steg_find(bitmap *bitmap, iterator *iter, struct arc4_stream *as,
 				j = i;
 				fprintf(stderr, "%5d: %5d(%3.1f%%)[%3.1f%%], bias %5d(%1.2f), saved: % 5d, total: %5.2f%%\n",
 					j, result.changed,
-					(float) 100 * steg_mis / steg_count,
-					(float) 100 * steg_mis / steg_data,
+					(float) 100 * result.changed / result.count,
+					(float) 100 * result.changed / steg_data,
 					result.bias,
-					(float)result.bias / steg_mis,
+					(float)result.bias / result.changed,
 					(half - result.changed) / 8,
-					(float) 100 * steg_mis / bitmap->bits);
+					(float) 100 * result.changed / bitmap->bits);
 			}
 		}
+		free(ss.results);
 
 		if (steg_stat && (chmax - chmin > 1)) {
 			double mean = 0, dev, sq;
@@ -603,8 +845,7 @@ encode_data(u_char *data, int *len, struct arc4_stream *as, int flags)
 		return NULL;
 	}
 	/* Encryption */
-	for (j = 0; j < datalen; j++)
-		encdata[j] = data[j] ^ arc4_getbyte(as);
+	arc4_xor(as, encdata, data, datalen);
 
 	*len = datalen;
 
@@ -617,8 +858,7 @@ decode_data(u_char *encdata, int *len, struct arc4_stream *as, int flags)
 	int i, j, enclen = *len, declen;
 	u_char *data;
 
-	for (j = 0; j < enclen; j++)
-		encdata[j] = encdata[j] ^ arc4_getbyte(as);
+	arc4_xor(as, encdata, encdata, enclen);
 
 	if (flags & STEG_ERROR) {
 		u_int32_t inbits = 0, outbits = 0, etmp, dtmp;
@@ -683,7 +923,8 @@ do_embed(bitmap *bitmap, u_char *filename, u_char *key, u_int klen,
 	iterator iter;
 	struct arc4_stream as, tas;
 	u_char *encdata, *data;
-	u_int datalen, enclen;
+	size_t datalen;
+	u_int enclen;
 	size_t correctlen;
 	int j;
 
@@ -724,7 +965,7 @@ do_embed(bitmap *bitmap, u_char *filename, u_char *key, u_int klen,
 	}
 
 	*result = steg_embed(bitmap, &iter, &as, encdata, enclen, j,
-			    cfg->flags | STEG_EMBED);
+			    cfg->flags | STEG_EMBED, NULL);
 
  out:
 	free(encdata);
@@ -732,12 +973,38 @@ do_embed(bitmap *bitmap, u_char *filename, u_char *key, u_int klen,
 	return (j);
 }
 
+/* Maps len bytes of an open regular file */
+
+static u_char *
+mmap_fd(int fd, size_t len)
+{
+	u_char *p;
+#ifdef HAVE_MMAP
+	if ((p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+#else
+	size_t off;
+	ssize_t n;
+
+	p = checkedmalloc(len);
+	for (off = 0; off < len; off += n) {
+		if ((n = read(fd, p + off, len - off)) <= 0) {
+			perror("read");
+			exit(1);
+		}
+	}
+#endif /* HAVE_MMAP */
+
+	return (p);
+}
+
 void
-mmap_file(char *name, u_char **data, int *size)
+mmap_file(char *name, u_char **data, size_t *size)
 {
 	int fd;
 	struct stat fs;
-	char *p;
 
 	if ((fd = open(name, O_RDONLY, 0)) == -1) {
 		fprintf(stderr, "Can not open %s\n", name);
@@ -749,26 +1016,18 @@ mmap_file(char *name, u_char **data, int *size)
 		exit(1);
 	}
 
-#ifdef HAVE_MMAP
-	if ((p = mmap(NULL, fs.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-		perror("mmap");
+	if ((off_t)(size_t)fs.st_size != fs.st_size) {
+		fprintf(stderr, "%s: file too large\n", name);
 		exit(1);
 	}
-#else
-	p = checkedmalloc(fs.st_size);
-	if (read(fd, p, fs.st_size) != fs.st_size) {
-		perror("read");
-		exit(1);
-	}
-#endif /* HAVE_MMAP */
-	close(fd);
 
-	*data = p;
+	*data = mmap_fd(fd, fs.st_size);
 	*size = fs.st_size;
+	close(fd);
 }
 
 void
-munmap_file(u_char *data, int len)
+munmap_file(u_char *data, size_t len)
 {
 #ifdef HAVE_MMAP
 	if (munmap(data, len) == -1) {
@@ -794,6 +1053,8 @@ main(int argc, char **argv)
 		"\t-p <param>   parameter passed to destination data handler\n"
 		"\t-r           retrieve message from data\n"
 		"\t-x <n>       number of key derivations to be tried\n"
+		"\t-j <n>       number of threads to use, the default is 1\n"
+		"\t-M <size>    memory limit, larger arrays go to files in $TMPDIR\n"
 		"\t-m           mark pixels that have been modified\n"
 		"\t-t           collect statistic information\n"
 		"\t-F[+-]       turns statistical steganalysis foiling on/off.\n"
@@ -805,6 +1066,9 @@ main(int argc, char **argv)
 
 	char *progname;
 	FILE *fin = stdin, *fout = stdout;
+	u_char *indata = NULL;	/* mapped input file */
+	size_t inlen = 0;
+	struct stat fs;
 	image *image;
 	handler *srch = NULL, *dsth = NULL;
 	char *param = NULL;
@@ -821,7 +1085,7 @@ main(int argc, char **argv)
 	char mark = 0, doretrieve = 0;
 	char doerror = 0, doerror2 = 0;
 	char *cp;
-	int extractonly = 0, foil = 1;
+	int extractonly = 0, foil = 1, readflags = 0;
 #ifdef FOURIER
 	char dofourier = 0;
 #endif /* FOURIER */
@@ -845,7 +1109,7 @@ main(int argc, char **argv)
 	}
 
 	/* read command line arguments */
-	while ((ch = getopt(argc, argv, "heErmftp:s:S:i:I:k:d:D:K:x:F:")) != -1)
+	while ((ch = getopt(argc, argv, "heErmftp:s:S:i:I:j:k:d:D:K:M:x:F:")) != -1)
 		switch((char)ch) {
 		case 'h':
 			fprintf(stderr, usage, version, argv[0]);
@@ -866,6 +1130,12 @@ main(int argc, char **argv)
 		case 'x':
 			derive = atoi(optarg);
 			break;
+		case 'j':
+			jobs_setthreads(atoi(optarg));
+			break;
+		case 'M':
+			spill_setlimit(spill_parse(optarg));
+			break;
 		case 'i':
 			cfg1.siter = atoi(optarg);
 			break;
@@ -941,6 +1211,17 @@ main(int argc, char **argv)
 			perror("fopen");
 			exit(1);
 		}
+		/*
+		 * The handler parses a regular file straight from the
+		 * mapping, pipes and empty files go through the stream.
+		 */
+		if (fstat(fileno(fin), &fs) == 0 && S_ISREG(fs.st_mode) &&
+		    fs.st_size > 0 && (off_t)(size_t)fs.st_size == fs.st_size) {
+			inlen = fs.st_size;
+			indata = mmap_fd(fileno(fin), inlen);
+			fclose(fin);
+			fin = NULL;
+		}
 		fout = fopen(argv[1], "wb");
 		if (fout == NULL) {
 			fprintf(stderr, "Can't open output file '%s': ",
@@ -961,8 +1242,30 @@ main(int argc, char **argv)
 		init_golay();
 	}
 
+	/*
+	 * Initialize destination data handler.  If the data goes back to
+	 * the handler it came from and no parameter asks for a different
+	 * encoding, the handler may keep it in its own representation,
+	 * e.g. JPEG coefficients.
+	 */
+	if (!doretrieve && !extractonly) {
+		if (dsth->init(param) == 0 && srch == dsth)
+			readflags |= STEG_NATIVE;
+	}
+	/* Only the bitmap is needed, the image data itself is not */
+	if (doretrieve || extractonly)
+		readflags |= STEG_RETRIEVE;
+#ifdef FOURIER
+	if (dofourier)
+		readflags &= ~STEG_NATIVE;
+#endif /* FOURIER */
+
 	fprintf(stderr, "Reading %s....\n", argv[0]);
-	image = srch->read(fin);
+	if (indata != NULL) {
+		image = srch->read_mem(indata, inlen, readflags);
+		munmap_file(indata, inlen);
+	} else
+		image = srch->read(fin, readflags);
 
 	if (extractonly) {
 		int bits;
@@ -978,8 +1281,6 @@ main(int argc, char **argv)
 		/* Wen extracting get the bitmap from the source handler */
 		srch->get_bitmap(&bitmap, image, STEG_RETRIEVE);
 	else {
-		/* Initialize destination data handler */
-		dsth->init(param);
 		/* When embedding the destination format determines the bits */
 		dsth->get_bitmap(&bitmap, image, 0);
 	}
@@ -1100,13 +1401,33 @@ main(int argc, char **argv)
 		dsth->put_bitmap (image, &bitmap, cfg1.flags);
 
 #ifdef FOURIER
-		if (dofourier)
+		if (dofourier) {
 			fft_image(image->x, image->y, image->depth,
 				  image->img);
+			/* The JPEG coefficients predate the transform */
+			if (dsth == &jpg_handler)
+				recompress_JPEG(image, &bitmap, cfg1.flags);
+		}
 #endif /* FOURIER */
 
 		fprintf(stderr, "Writing %s....\n", argv[1]);
-		dsth->write(fout, image);
+		/*
+		 * The handler builds the output in memory and it goes out
+		 * in one write.  Under a memory limit it is streamed instead.
+		 */
+		if (spill_limit())
+			dsth->write(fout, image);
+		else {
+			u_char *outdata;
+			size_t outlen;
+
+			dsth->write_mem(image, &outdata, &outlen);
+			if (fwrite(outdata, 1, outlen, fout) != outlen) {
+				perror("fwrite");
+				exit(1);
+			}
+			free(outdata);
+		}
 	} else {
 		/* Initialize random data stream */
 		arc4_initkey(&as,  "Encryption", key, strlen(key));
@@ -1126,6 +1447,8 @@ main(int argc, char **argv)
 
 	free(bitmap.bitmap);
 	free(bitmap.locked);
+	spill_free(bitmap.detect);
+	spill_free(bitmap.data);
 
 	free_pnm(image);
 
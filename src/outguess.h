@@ -46,6 +46,9 @@
 
 #define STEG_STATS	0x20
 
+#define STEG_NATIVE	0x40	/* data is written back by the handler that
+				 * read it, it may stay in its own encoding */
+
 extern int steg_stat;
 
 /*
@@ -66,15 +69,18 @@ typedef struct _bitmap {
 
 				/* function to call for preserve stats */
 	int (*preserve)(struct _bitmap *, int);
+	void *priv;		/* private data of the preserve function */
 	size_t maxcorrect;
 } bitmap;
 
 #define STEG_ERR_HEADER		1
 #define STEG_ERR_BODY		2
 #define STEG_ERR_PERM		3	/* error independant of seed */
+#define STEG_ERR_COST		4	/* costs more than the ceiling */
 
 typedef struct _stegres {
 	int error;		/* Errors during steg embed */
+	int count;		/* Number of embedded bits */
 	int changed;		/* Number of changed bits in data */
 	int bias;		/* Accumulated bias of changed bits */
 } stegres;
@@ -97,16 +103,17 @@ u_char *encode_data(u_char *, int *, struct arc4_stream *, int);
 u_char *decode_data(u_char *, int *, struct arc4_stream *, int);
 
 struct _iterator;
+struct stegsearch;
 
 stegres steg_embed(bitmap *bitmap, struct _iterator *iter,
 		   struct arc4_stream *as, u_char *data, u_int datalen,
-		   u_int16_t seed, int embed);
+		   u_int16_t seed, int embed, struct stegsearch *search);
 u_int32_t steg_retrbyte(bitmap *bitmap, int bits, struct _iterator *iter);
 
 char *steg_retrieve(int *len, bitmap *bitmap, struct _iterator *iter,
 		    struct arc4_stream *as, int);
 
-void mmap_file(char *name, u_char **data, int *size);
-void munmap_file(u_char *data, int len);
+void mmap_file(char *name, u_char **data, size_t *size);
+void munmap_file(u_char *data, size_t len);
 
 #endif /* _OUTGUESS_H */
@@ -39,6 +39,7 @@
  */
 
 #include <sys/types.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -47,6 +48,7 @@
 #include "config.h"
 #include "outguess.h"
 #include "pnm.h"
+#include "spill.h"
 
 /* The functions that can be used to handle a PNM data object */
 
@@ -56,14 +58,32 @@ handler pnm_handler = {
 	init_pnm,
 	read_pnm,
 	write_pnm,
+	read_pnm_mem,
+	write_pnm_mem,
 	bitmap_from_pnm,
 	bitmap_to_pnm,
 	preserve_pnm,
 };
 
-void
+/* Grayscale images are read and written by the same functions */
+
+handler pgm_handler = {
+	"pgm",
+	NULL,
+	init_pnm,
+	read_pnm,
+	write_pnm,
+	read_pnm_mem,
+	write_pnm_mem,
+	bitmap_from_pnm,
+	bitmap_to_pnm,
+	preserve_pnm,
+};
+
+int
 init_pnm(char *parameter)
 {
+	return (0);
 }
 
 int
@@ -76,20 +96,38 @@ preserve_pnm(bitmap *bitmap, int off)
 }
 
 /* skip whitespace and comments in PGM/PPM headers */
-void
-skip_white(FILE *f)
+static const u_char *
+skip_white(const u_char *p, const u_char *end)
 {
-	int c;
+	while (p < end) {
+		if (*p == '#')
+			while (p < end && *p != '\n')
+				p++;
+		else if (isspace(*p))
+			p++;
+		else
+			break;
+	}
 
-	do {
-		while (isspace(c = getc(f)));
-		if (c == '#')
-			while ((c = getc(f)) != '\n' && c != EOF);
-		else {
-			ungetc(c, f);
-			return;
-		}
-	} while (c != EOF);
+	return (p);
+}
+
+/* read a decimal number, returns NULL if there is none */
+static const u_char *
+read_number(const u_char *p, const u_char *end, int *v)
+{
+	const u_char *start;
+	int neg = 0, n = 0;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	for (start = p; p < end && isdigit(*p); p++)
+		n = n < INT_MAX / 10 ? n * 10 + (*p - '0') : INT_MAX;
+	if (p == start)
+		return (NULL);
+
+	*v = neg ? -n : n;
+	return (p);
 }
 
 void
@@ -134,8 +172,8 @@ bitmap_from_pnm(bitmap *bitmap, image *image, int flags)
 	bitmap->bitmap = checkedmalloc(bitmap->bytes);
 	bitmap->locked = checkedmalloc(bitmap->bytes);
 	bitmap->metalock = checkedmalloc(bitmap->bytes);
-	bitmap->detect = checkedmalloc(bitmap->bits);
-	bitmap->data = checkedmalloc(bitmap->bits);
+	bitmap->detect = spill_alloc(bitmap->bits);
+	bitmap->data = spill_alloc(bitmap->bits);
 
 	memset (bitmap->locked, 0, bitmap->bytes);
 
@@ -160,53 +198,79 @@ bitmap_from_pnm(bitmap *bitmap, image *image, int flags)
 }
 
 
+/*
+ * The whole input is read into memory and parsed there, so that files
+ * and buffers share one parser.
+ */
+
+image *
+read_pnm(FILE *fin, int flags)
+{
+	image *image;
+	u_char *data = NULL, *p;
+	size_t len = 0, size = 0, n;
+
+	do {
+		if (len == size) {
+			size = size ? size * 2 : 65536;
+			if ((p = realloc(data, size)) == NULL) {
+				fprintf(stderr, "read_pnm: not enough memory\n");
+				exit(1);
+			}
+			data = p;
+		}
+		n = fread(data + len, 1, size - len, fin);
+		len += n;
+	} while (n > 0);
+
+	if (ferror(fin)) {
+		perror("Error occurred while reading input file");
+		exit(1);
+	}
+
+	image = read_pnm_mem(data, len, flags);
+	free(data);
+
+	return image;
+}
+
 image *
-read_pnm(FILE *fin)
+read_pnm_mem(const u_char *data, size_t len, int flags)
 {
 	image *image;
-	char magic[10];
+	const u_char *p = data, *end = data + len;
+	size_t i, size;
 	int v;
 
 	image = checkedmalloc(sizeof(*image));
 	memset(image, 0, sizeof(*image));
 
-	const char* const getsRet = fgets(magic, 10, fin);
-	if (getsRet == NULL) {
-		fprintf(stderr, "Failed to read the magic value of the image!\n");
-		fprintf(stderr, "This suggest either an I/O error, ");
-		fprintf(stderr, "or that the file is invalid.\n");
-		exit(1);
-	}
-	if (magic[0] != 'P' || !isdigit(magic[1]) || magic[2] != '\n') {
+	if (len < 3 || p[0] != 'P' || !isdigit(p[1]) || p[2] != '\n') {
 		fprintf(stderr, "Unsupported input file type!\n");
 		exit(1);
 	}
-	skip_white(fin);
-	int nScanned = fscanf(fin, "%d", &image->x);
-	if (nScanned != 1) {
+	p += 3;
+	if ((p = read_number(skip_white(p, end), end, &image->x)) == NULL) {
 		fprintf(stderr, "Failed to read image width!\n");
 		exit(1);
 	}
-	skip_white(fin);
-	nScanned = fscanf(fin, "%d", &image->y);
-	if (nScanned != 1) {
+	if ((p = read_number(skip_white(p, end), end, &image->y)) == NULL) {
 		fprintf(stderr, "Failed to read image height!\n");
 		exit(1);
 	}
-	skip_white(fin);
-	nScanned = fscanf(fin, "%d", &image->max);
-	if (nScanned != 1) {
+	if ((p = read_number(skip_white(p, end), end, &image->max)) == NULL) {
 		fprintf(stderr, "Failed to read image max pixel value!\n");
 		exit(1);
 	}
-	getc(fin);
+	if (p < end)
+		p++;		/* single white space before the raster */
 	if (image->max > 255 || image->max <= 0 || image->x <= 1 ||
 	    image->y <= 1) {
 		fprintf(stderr, "Unsupported value range!\n");
 		exit(1);
 	}
 
-	switch (magic[1]) {
+	switch (data[1]) {
 	case '2': /* PGM ASCII */
 	case '5': /* PGM binary */
 		image->depth = 1; /* up to 8 bit/pixel */
@@ -216,21 +280,20 @@ read_pnm(FILE *fin)
 		image->depth = 3; /* up to 24 bit/pixel */
 		break;
 	default:
-		fprintf(stderr, "Unsupported input file type 'P%c'!\n", magic[1]);
+		fprintf(stderr, "Unsupported input file type 'P%c'!\n", data[1]);
 		exit(1);
 	}
 
+	size = (size_t)image->x * image->y * image->depth;
 	image->img = (unsigned char *) checkedmalloc(sizeof(unsigned char) *
-						     image->x * image->y *
-						     image->depth);
+						     size);
 
-	switch (magic[1]) {
+	switch (data[1]) {
 	case '2': /* PGM ASCII */
 	case '3': /* PPM ASCII */
-		for (size_t i = 0; i < image->x * image->y * image->depth; i++) {
-			skip_white(fin);
-			nScanned = fscanf(fin, "%d", &v);
-			if (nScanned != 1) {
+		for (i = 0; i < size; i++) {
+			p = read_number(skip_white(p, end), end, &v);
+			if (p == NULL) {
 				fprintf(stderr, "Failed to read image pixel value!\n");
 				exit(1);
 			}
@@ -243,26 +306,16 @@ read_pnm(FILE *fin)
 		break;
 	case '5': /* PGM binary */
 	case '6': /* PPM binary */
-		if (fread(image->img, image->x * image->depth, image->y, fin)
-				!= image->y)
-		{
+		if ((size_t)(end - p) < size) {
 			fprintf(stderr, "Failed to read PPM image data!\n");
 			fprintf(stderr, "This suggest either an I/O error, ");
 			fprintf(stderr, "or that the file is invalid.\n");
 			exit(1);
 		}
+		memcpy(image->img, p, size);
 		break;
 	}
 
-	if (ferror(fin)) {
-		perror("Error occurred while reading input file");
-		exit(1);
-	}
-	if (feof(fin)) {
-		fprintf(stderr, "Unexpected end of input file!\n");
-		exit(1);
-	}
-
 	return image;
 }
 
@@ -276,6 +329,23 @@ write_pnm(FILE *fout, image *image)
 	       fout);
 }
 
+void
+write_pnm_mem(image *image, u_char **data, size_t *len)
+{
+	char header[64];
+	size_t hlen, size;
+
+	hlen = snprintf(header, sizeof(header), "P%d\n%d %d\n%d\n",
+			image->depth == 1 ? 5 : 6,
+			image->x, image->y, image->max);
+	size = (size_t)image->x * image->y * image->depth;
+
+	*data = checkedmalloc(hlen + size);
+	memcpy(*data, header, hlen);
+	memcpy(*data + hlen, image->img, size);
+	*len = hlen + size;
+}
+
 void
 free_pnm(image *image)
 {
@@ -49,32 +49,36 @@ typedef struct _image {
 	u_char *img;
 	bitmap *bitmap;
 	int flags;
+	void *priv;		/* private data of the reading handler */
 } image;
 
 typedef struct _handler {
 	char *extension;				/* Extension name */
 	char *extension_alternative;		/* Extension name */
-	void (*init)(char *);
-	image *(*read)(FILE *);
+	int (*init)(char *);			/* 1 if data must be re-encoded */
+	image *(*read)(FILE *, int);
 	void (*write)(FILE *, image *);
+	image *(*read_mem)(const u_char *, size_t, int);
+	void (*write_mem)(image *, u_char **, size_t *);
 	void (*get_bitmap)(bitmap *, image *, int);
 	void (*put_bitmap)(image *, bitmap *, int);
 	int (*preserve)(bitmap *, int);
 } handler;
 
 extern handler pnm_handler;
+extern handler pgm_handler;
 
-void skip_white(FILE *f);
-
-void init_pnm(char *);
+int init_pnm(char *);
 
 int preserve_pnm(bitmap *, int);
 
 void bitmap_to_pnm(image *img, bitmap *bitmap, int flags);
 void bitmap_from_pnm(bitmap *bitmap, image *image, int flags);
 
-image *read_pnm(FILE *fin);
+image *read_pnm(FILE *fin, int flags);
 void write_pnm(FILE *fout, image *image);
+image *read_pnm_mem(const u_char *data, size_t len, int flags);
+void write_pnm_mem(image *image, u_char **data, size_t *len);
 
 void free_pnm(image *image);
 
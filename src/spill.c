@@ -0,0 +1,200 @@
+/*
+ * This file is under the same license of the outguess.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif /* HAVE_MMAP */
+
+#include "outguess.h"
+#include "spill.h"
+
+/*
+ * Half of the limit is left to the JPEG library for its coefficient
+ * arrays, the other half is for the per bit arrays allocated here.
+ * Allocations only happen on the main thread.
+ */
+
+struct spill {
+	struct spill *next;
+	void *addr;
+	size_t len;
+	int mapped;		/* addr is a mapping of a temporary file */
+};
+
+static struct spill *spills;
+static size_t limit;		/* 0 means no limit */
+static size_t inuse;		/* bytes of the arrays held in memory */
+
+void
+spill_setlimit(size_t n)
+{
+	limit = n;
+}
+
+size_t
+spill_limit(void)
+{
+	return (limit);
+}
+
+/* Parses a size in bytes with an optional k, M or G suffix */
+
+size_t
+spill_parse(const char *str)
+{
+	unsigned long long n;
+	char *end;
+
+	n = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'g': case 'G':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		n <<= 10;
+		end++;
+		break;
+	}
+	if (end == str || *end != '\0') {
+		fprintf(stderr, "spill_parse: bad size: %s\n", str);
+		exit(1);
+	}
+
+	return ((size_t)n);
+}
+
+#if defined(HAVE_MMAP) && defined(HAVE_UNISTD_H)
+static void *
+spill_map(size_t n)
+{
+	char path[1024];
+	const char *dir;
+	void *p;
+	int fd;
+
+	if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+		dir = "/tmp";
+	snprintf(path, sizeof(path), "%s/outguess.XXXXXX", dir);
+	if ((fd = mkstemp(path)) == -1) {
+		perror(path);
+		exit(1);
+	}
+	/* The file goes away with the mapping */
+	unlink(path);
+
+	if (ftruncate(fd, n) == -1) {
+		perror("ftruncate");
+		exit(1);
+	}
+	p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	return (p);
+}
+#define SPILL_SUPPORTED
+#endif /* HAVE_MMAP && HAVE_UNISTD_H */
+
+void *
+spill_alloc(size_t n)
+{
+	struct spill *s;
+
+	if (n == 0)
+		n = 1;
+
+	s = checkedmalloc(sizeof(*s));
+	s->len = n;
+	s->mapped = 0;
+#ifdef SPILL_SUPPORTED
+	if (limit && inuse + n > limit / 2) {
+		s->addr = spill_map(n);
+		s->mapped = 1;
+	} else
+#endif /* SPILL_SUPPORTED */
+	{
+		s->addr = checkedmalloc(n);
+		inuse += n;
+	}
+
+	s->next = spills;
+	spills = s;
+
+	return (s->addr);
+}
+
+static struct spill **
+spill_find(void *p)
+{
+	struct spill **ps;
+
+	for (ps = &spills; *ps != NULL; ps = &(*ps)->next)
+		if ((*ps)->addr == p)
+			return (ps);
+
+	fprintf(stderr, "spill_find: unknown array\n");
+	abort();
+}
+
+/* Shrinks an array to its first n bytes */
+
+void *
+spill_trim(void *p, size_t n)
+{
+	struct spill *s = *spill_find(p);
+
+	if (n == 0)
+		n = 1;
+	if (s->mapped || n >= s->len)
+		return (p);
+
+	if ((p = realloc(p, n)) == NULL)
+		return (s->addr);
+
+	inuse -= s->len - n;
+	s->addr = p;
+	s->len = n;
+
+	return (p);
+}
+
+void
+spill_free(void *p)
+{
+	struct spill **ps, *s;
+
+	if (p == NULL)
+		return;
+
+	ps = spill_find(p);
+	s = *ps;
+	*ps = s->next;
+
+#ifdef SPILL_SUPPORTED
+	if (s->mapped)
+		munmap(s->addr, s->len);
+	else
+#endif /* SPILL_SUPPORTED */
+	{
+		free(s->addr);
+		inuse -= s->len;
+	}
+	free(s);
+}
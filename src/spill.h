@@ -0,0 +1,24 @@
+/*
+ * This file is under the same license of the outguess.
+ */
+
+#ifndef _SPILL_H
+#define _SPILL_H
+
+/*
+ * Keeps the memory used for very large images below a limit.  Arrays
+ * that do not fit any more are mapped from temporary files in $TMPDIR,
+ * and the JPEG library moves its coefficient arrays to backing store.
+ * Without a limit, everything comes from malloc.
+ */
+
+void spill_setlimit(size_t);
+size_t spill_limit(void);
+size_t spill_parse(const char *);
+
+/* Like checkedmalloc, but may return a mapping of a temporary file */
+void *spill_alloc(size_t n);
+void *spill_trim(void *p, size_t n);
+void spill_free(void *p);
+
+#endif /* _SPILL_H */
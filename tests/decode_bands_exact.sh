@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# A JPEG cover decoded to pixels is split in bands on several threads,
+# the pixels must not change
+echo -e "\nEmbedding into a recompressed JPEG on one and on four threads..."
+../src/outguess -j 1 -k "secret-key-001" -p 90 -d message.txt test.jpg test-bands1.jpg
+../src/outguess -j 4 -k "secret-key-001" -p 90 -d message.txt test.jpg test-bands4.jpg
+
+cmp test-bands1.jpg test-bands4.jpg || { echo ERROR; exit 1; }
+
+echo -e "\nEmbedding from a JPEG into a PNM on one and on four threads..."
+../src/outguess -j 1 -k "secret-key-001" -d message.txt test.jpg test-bands1.pnm
+../src/outguess -j 4 -k "secret-key-001" -d message.txt test.jpg test-bands4.pnm
+
+cmp test-bands1.pnm test-bands4.pnm || { echo ERROR; exit 1; }
+
+echo -e "\nExtracting a message..."
+../src/outguess -j 4 -k "secret-key-001" -r test-bands4.pnm text-bands.txt
+cat text-bands.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-bands1.jpg test-bands4.jpg test-bands1.pnm test-bands4.pnm \
+      text-bands.txt
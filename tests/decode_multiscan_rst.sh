@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# A sequential JPEG with one scan per component and restart markers,
+# where only the luma scan has enough segments to be decoded in parallel
+echo -e "\nEmbedding into a multi-scan JPEG on one and on four threads..."
+../src/outguess -j 1 -k "secret-key-001" -d message.txt test-multiscan-rst.jpg test-multiscan1.jpg || { echo ERROR; exit 1; }
+../src/outguess -j 4 -k "secret-key-001" -d message.txt test-multiscan-rst.jpg test-multiscan4.jpg || { echo ERROR; exit 1; }
+
+cmp test-multiscan1.jpg test-multiscan4.jpg || { echo ERROR; exit 1; }
+
+echo -e "\nExtracting a message on four threads..."
+../src/outguess -j 4 -k "secret-key-001" -r test-multiscan4.jpg text-multiscan.txt
+cat text-multiscan.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-multiscan1.jpg test-multiscan4.jpg text-multiscan.txt
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# Write message without and with a memory limit that is far too small
+echo -e "\nEmbedding a message..."
+../src/outguess -k "secret-key-001" -d message.txt test.jpg test-with-message-mem.jpg
+../src/outguess -k "secret-key-001" -M 16k -d message.txt test.jpg test-with-message-mem16k.jpg
+../src/outguess -k "secret-key-001" -p 90 -d message.txt test.jpg test-with-message-memq.jpg
+../src/outguess -k "secret-key-001" -p 90 -M 16k -d message.txt test.jpg test-with-message-memq16k.jpg
+../src/outguess -k "secret-key-001" -p 90,rst -j 4 -d message.txt test.jpg test-with-message-memr.jpg
+../src/outguess -k "secret-key-001" -p 90,rst -j 4 -M 16k -d message.txt test.jpg test-with-message-memr16k.jpg
+
+# Arrays in temporary files must not change the output
+cmp test-with-message-mem.jpg test-with-message-mem16k.jpg || { echo ERROR; exit 1; }
+cmp test-with-message-memq.jpg test-with-message-memq16k.jpg || { echo ERROR; exit 1; }
+cmp test-with-message-memr.jpg test-with-message-memr16k.jpg || { echo ERROR; exit 1; }
+
+# Retrieve message under the limit as well
+echo -e "\nExtracting a message..."
+../src/outguess -k "secret-key-001" -M 16k -r test-with-message-mem16k.jpg text-jpg-mem.txt
+cat text-jpg-mem.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+../src/outguess -k "secret-key-001" -j 4 -M 16k -r test-with-message-memr16k.jpg text-jpg-mem.txt
+cat text-jpg-mem.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-with-message-mem.jpg test-with-message-mem16k.jpg \
+      test-with-message-memq.jpg test-with-message-memq16k.jpg \
+      test-with-message-memr.jpg test-with-message-memr16k.jpg text-jpg-mem.txt
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# Write message, once with the standard and once with optimized Huffman tables
+echo -e "\nEmbedding a message..."
+../src/outguess -k "secret-key-001" -d message.txt test.jpg test-with-message-std.jpg
+../src/outguess -k "secret-key-001" -p opt -d message.txt test.jpg test-with-message-opt.jpg
+
+# The optimized tables must not make the image larger
+[ $(wc -c < test-with-message-opt.jpg) -lt $(wc -c < test-with-message-std.jpg) ] || { echo ERROR; exit 1; }
+
+# Retrieve message
+echo -e "\nExtracting a message..."
+../src/outguess -k "secret-key-001" -r test-with-message-opt.jpg text-jpg-opt.txt
+cat text-jpg-opt.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-with-message-std.jpg test-with-message-opt.jpg text-jpg-opt.txt
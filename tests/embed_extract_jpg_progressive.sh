@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# Write message into a progressive JPEG
+echo -e "\nEmbedding a message..."
+../src/outguess -k "secret-key-001" -d message.txt test-progressive.jpg test-with-message-prog.jpg
+
+# The stego image must stay progressive (SOF2 marker)
+LC_ALL=C grep -q $'\xff\xc2' test-with-message-prog.jpg || { echo ERROR; exit 1; }
+
+# Retrieve message
+echo -e "\nExtracting a message..."
+../src/outguess -k "secret-key-001" -r test-with-message-prog.jpg text-jpg-prog.txt
+cat text-jpg-prog.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-with-message-prog.jpg text-jpg-prog.txt
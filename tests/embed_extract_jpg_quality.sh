@@ -0,0 +1,15 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# Write message, compressing the image again with a given quality
+echo -e "\nEmbedding a message..."
+../src/outguess -k "secret-key-001" -p 90 -d message.txt test.jpg test-with-message-q90.jpg
+
+# Retrieve message
+echo -e "\nExtracting a message..."
+../src/outguess -k "secret-key-001" -r test-with-message-q90.jpg text-jpg-q90.txt
+cat text-jpg-q90.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-with-message-q90.jpg text-jpg-q90.txt
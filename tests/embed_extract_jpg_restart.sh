@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# Write message with restart markers, on one and on several threads
+echo -e "\nEmbedding a message..."
+../src/outguess -k "secret-key-001" -p rst -d message.txt test.jpg test-with-message-rst1.jpg
+../src/outguess -k "secret-key-001" -p rst -j 4 -d message.txt test.jpg test-with-message-rst4.jpg
+
+# The threads must not change the output, which has RST markers
+cmp test-with-message-rst1.jpg test-with-message-rst4.jpg || { echo ERROR; exit 1; }
+LC_ALL=C grep -q $'\xff\xd0' test-with-message-rst4.jpg || { echo ERROR; exit 1; }
+
+# Retrieve message, decoding the restart intervals in parallel
+echo -e "\nExtracting a message..."
+../src/outguess -k "secret-key-001" -j 4 -r test-with-message-rst4.jpg text-jpg-rst.txt
+cat text-jpg-rst.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-with-message-rst1.jpg test-with-message-rst4.jpg text-jpg-rst.txt
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# Write message into a grayscale image, compressing it to a grayscale JPEG
+echo -e "\nEmbedding a message..."
+../src/outguess -k "secret-key-001" -d message.txt test.pgm test-with-message-gray.jpg
+
+# Retrieve message
+echo -e "\nExtracting a message..."
+../src/outguess -k "secret-key-001" -r test-with-message-gray.jpg text-pgm.txt
+cat text-pgm.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Write message into the grayscale JPEG again, keeping its coefficients
+echo -e "\nEmbedding a message..."
+../src/outguess -k "secret-key-002" -d message.txt test-with-message-gray.jpg test-with-message-gray2.jpg
+
+# Retrieve message
+echo -e "\nExtracting a message..."
+../src/outguess -k "secret-key-002" -r test-with-message-gray2.jpg text-pgm.txt
+cat text-pgm.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-with-message-gray.jpg test-with-message-gray2.jpg text-pgm.txt
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# The SSE2 code must produce the same image as the C code
+echo -e "\nEmbedding a message with SIMD..."
+../src/outguess -k "secret-key-001" -d message.txt test.ppm test-simd.jpg
+
+echo -e "\nEmbedding a message without SIMD..."
+JSIMD_FORCENONE=1 \
+../src/outguess -k "secret-key-001" -d message.txt test.ppm test-nosimd.jpg
+
+cmp test-simd.jpg test-nosimd.jpg || { echo ERROR; exit 1; }
+
+# A JPEG cover with -p is decoded to pixels first
+echo -e "\nEmbedding a message into a JPEG with SIMD..."
+../src/outguess -k "secret-key-001" -p 90 -d message.txt test.jpg test-simd.jpg
+
+echo -e "\nEmbedding a message into a JPEG without SIMD..."
+JSIMD_FORCENONE=1 \
+../src/outguess -k "secret-key-001" -p 90 -d message.txt test.jpg test-nosimd.jpg
+
+cmp test-simd.jpg test-nosimd.jpg || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f test-simd.jpg test-nosimd.jpg
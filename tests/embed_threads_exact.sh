@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# The seeds are tried on several threads, the best one must not change
+for e in "" "-e"; do
+	echo -e "\nEmbedding a message on one and on four threads $e..."
+	../src/outguess -k "secret-key-001" $e -d message.txt test.ppm test-threads1.jpg
+	../src/outguess -k "secret-key-001" $e -j 4 -d message.txt test.ppm test-threads4.jpg
+
+	cmp test-threads1.jpg test-threads4.jpg || { echo ERROR; exit 1; }
+
+	echo -e "\nExtracting a message..."
+	../src/outguess -k "secret-key-001" $e -r test-threads4.jpg text-threads.txt
+	cat text-threads.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+done
+
+# Remove files
+rm -f test-threads1.jpg test-threads4.jpg text-threads.txt
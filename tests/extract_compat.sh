@@ -0,0 +1,16 @@
+#!/bin/bash
+
+# This file is under BSD-3-Clause license.
+
+# Messages embedded by OutGuess 0.4 must still be found, which needs
+# the same key stream and the same bit selection.
+echo -e "\nExtracting a message embedded by OutGuess 0.4..."
+../src/outguess -k "secret-key-001" -r test-stego-0.4.jpg text-compat.txt
+cat text-compat.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+echo -e "\nExtracting a message embedded by OutGuess 0.4 with ECC..."
+../src/outguess -k "secret-key-001" -e -r test-stego-0.4-ecc.jpg text-compat.txt
+cat text-compat.txt | grep "inside of the image" || { echo ERROR; exit 1; }
+
+# Remove files
+rm -f text-compat.txt